@@ -13,9 +13,7 @@ const int max_output_args = 10;
 int apex_register_policy(lua_State *L) {
   int n = lua_gettop(L);
   Bytecode b;
-  lua_pushvalue(L,1);
-  lua_dump(L,(lua_Writer)lua_write,&b.data);
-  lua_pop(L,1);
+  dump_function(L,1,b.data);
   std::set<apex_event_type> when;
   for(int i=2;i<=n;i++) {
     if(lua_isstring(L,i)) {
@@ -40,7 +38,10 @@ int apex_register_policy(lua_State *L) {
     LuaEnv lenv;
     lua_State *L = lenv;
     lua_pop(L,lua_gettop(L));
-    lua_load(L,(lua_Reader)lua_read,(void *)&b.data,0,"b");
+    if(load_cached(L,b.data) != LUA_OK) {
+      SHOW_ERROR(L);
+      return APEX_NOERROR;
+    }
     std::string str;
     switch(context.event_type) {
       CASE(APEX_STARTUP)
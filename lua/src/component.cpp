@@ -16,17 +16,21 @@ struct lua_component
 {
   table_ptr tp{new table_inner};
 
-  ptr_type get(std::string name) {
-    ptr_type pt{new std::vector<Holder>()};
-    pt->push_back((tp->t)[name]);
+  ptr_type get(atom name) {
+    ptr_type pt{make_pooled<holder_list>()};
+    auto search = tp->t.find(name);
+    if(search != tp->t.end())
+      pt->push_back(search->second);
+    else
+      pt->push_back(Holder());
     return pt;
   }
 
   HPX_DEFINE_COMPONENT_DIRECT_ACTION(lua_component,get);
 
-  ptr_type set(std::string name,Holder h) {
-    ptr_type pt{new std::vector<Holder>()};
-    (tp->t)[name] = h;
+  ptr_type set(atom name,Holder h) {
+    ptr_type pt{make_pooled<holder_list>()};
+    (tp->t)[std::move(name)] = std::move(h);
     return pt;
   }
 
@@ -71,10 +75,10 @@ struct lua_client
   }
 };
 
-hpx::future<ptr_type> lua_aux_client::get(std::string name)
+hpx::future<ptr_type> lua_aux_client::get(atom name)
 {
   lua_component::get_action act;
-  return hpx::async(act, id, name);
+  return hpx::async(act, id, std::move(name));
 }
 
 hpx::future<ptr_type> lua_aux_client::call(closure_ptr cp,ptr_type ptargs)
@@ -83,33 +87,40 @@ hpx::future<ptr_type> lua_aux_client::call(closure_ptr cp,ptr_type ptargs)
   return hpx::async(act, id, cp, ptargs);
 }
 
-hpx::future<ptr_type> lua_aux_client::set(std::string name,Holder h) {
+hpx::future<ptr_type> lua_aux_client::set(atom name,Holder h) {
   lua_component::set_action act;
-  return hpx::async(act, id, name, h);
+  return hpx::async(act, id, std::move(name), std::move(h));
 }
 
 ptr_type lua_component::call(closure_ptr cp,ptr_type ptargs) {
-  ptr_type pt{new std::vector<Holder>};
+  ptr_type pt{make_pooled<holder_list>()};
   bool found = false;
+  expand_closure(*cp);
+  expand_frozen(*cp);
+  expand_frozen(*ptargs);
   if(is_bytecode(cp->code.data)) {
     found = true;
   } else {
-    Holder hbyte = (tp->t)[cp->code.data];
-    if(hbyte.var.which() == Holder::bytecode_t) {
-      cp->code = boost::get<Bytecode>(hbyte.var);
+    auto search = tp->t.find(cp->code.data);
+    const int which = search == tp->t.end() ? int(Holder::empty_t) : search->second.var.which();
+    if(which == Holder::bytecode_t) {
+      cp->code = boost::get<Bytecode>(search->second.var);
       found = true;
-    } else if(hbyte.var.which() == Holder::closure_t) {
-      cp = boost::get<closure_ptr>(hbyte.var);
+    } else if(which == Holder::closure_t) {
+      cp = boost::get<closure_ptr>(search->second.var);
       found = true;
     } else {
-      std::cout << "Which = " << hbyte.var.which() << " code=" << cp->code.data << std::endl;
+      std::cout << "Which = " << which << " code=" << cp->code.data << std::endl;
     }
   }
   if(found) {
     LuaEnv lenv;
     lua_State *L = lenv.get_state();
     lua_pop(L,lua_gettop(L));
-    lua_load(L,(lua_Reader)lua_read,(void *)&cp->code.data,0,"b");
+    if(load_cached(L,cp->code.data,cp->hash) != LUA_OK) {
+      SHOW_ERROR(L);
+      return pt;
+    }
     new_table(L);
     table_ptr *ntp = (table_ptr *)lua_touserdata(L,-1);
     *ntp = tp;
@@ -122,10 +133,12 @@ ptr_type lua_component::call(closure_ptr cp,ptr_type ptargs) {
     while(lua_gettop(L)>1 && lua_isnil(L,-1))
       lua_pop(L,1);
     int nargs = lua_gettop(L);
+    pack_memo memo;
+    memo.flatten = true;
     for(int i=1;i<=nargs;i++) {
       Holder h;
-      h.pack(L,i);
-      pt->push_back(h);
+      h.pack(L,i,&memo);
+      pt->push_back(std::move(h));
     }
   }
   return pt;
@@ -163,7 +176,7 @@ int hpx_component_clean(lua_State *L) {
 int lua_client_get(lua_State *L) {
     if(lua_isstring(L,-1) && cmp_meta(L,-2,lua_client_metatable_name)) {
       lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-2);
-      std::string key = lua_tostring(L,-1);
+      atom key = lua_atom(L,-1);
       lua_pop(L,2);
       new_future(L);
       future_type *fc =
@@ -189,26 +202,34 @@ int lua_client_getid(lua_State *L) {
 int lua_client_call(lua_State *L) {
     if(cmp_meta(L,1,lua_client_metatable_name)) {
       lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,1);
-      closure_ptr cp{new Closure()};
+      closure_ptr cp{make_pooled<Closure>()};
       if(lua_isstring(L,2)) {
         cp->code.data = lua_tostring(L,2);
       } else if(lua_isfunction(L,2)) {
-        lua_pushvalue(L,2);
-        lua_dump(L,(lua_Writer)lua_write,&cp->code.data);
-        lua_pop(L,1);
+        dump_function(L,2,cp->code.data);
       }
-      ptr_type pt{new std::vector<Holder>};
+      ptr_type pt{make_pooled<holder_list>()};
       int nargs = lua_gettop(L);
+      pack_memo memo;
+      memo.flatten = true;
       for(int i=3;i<=nargs;i++) {
         Holder h;
-        h.pack(L,i);
-        pt->push_back(h);
+        h.pack(L,i,&memo);
+        pt->push_back(std::move(h));
       }
       lua_pop(L,lua_gettop(L));
       new_future(L);
       future_type *fc =
         (future_type *)lua_touserdata(L,-1);
-      *fc = lcp->call(cp,pt);
+      ptr_type keep(make_pooled<holder_list>());
+      compact_closure(*cp,lcp->id);
+      compact_frozen(*cp,lcp->id,*keep);
+      compact_frozen(*pt,lcp->id,*keep);
+      lua_aux_client lc = *lcp;
+      *fc = keep_frozen(after_registration(lc.id,[lc,cp,pt]() {
+        lua_aux_client c = lc;
+        return c.call(cp,pt);
+      }),keep);
       return 1;
     }
     return 0;
@@ -217,10 +238,10 @@ int lua_client_call(lua_State *L) {
 int lua_client_set(lua_State *L) {
     if(lua_isstring(L,-2) && cmp_meta(L,-3,lua_client_metatable_name)) {
       lua_aux_client *lcp = (lua_aux_client *)lua_touserdata(L,-3);
-      std::string key = lua_tostring(L,-2);
+      atom key = lua_atom(L,-2);
       Holder h;
       h.pack(L,-1);
-      future_type ff = lcp->set(key,h);
+      future_type ff = lcp->set(key,std::move(h));
       lua_pop(L,lua_gettop(L));
       new_future(L);
       future_type *fc =
@@ -240,9 +261,9 @@ int open_component(lua_State *L) {
     static const struct luaL_Reg component_meta_funcs [] = {
         {"Get",&lua_client_get},
         {"GetId",&lua_client_getid},
-        {"Set",&lua_client_set},
+        {"Set",&lua_packing<lua_client_set>},
         {"Name",&lua_client_name},
-        {"Call",&lua_client_call},
+        {"Call",&lua_packing<lua_client_call>},
         {NULL,NULL},
     };
 
@@ -254,6 +275,7 @@ int open_component(lua_State *L) {
     luaL_newlib(L,component_funcs);
 
     luaL_newmetatable(L,lua_client_metatable_name);
+    tag_metatable(L,lua_client_metatable_name);
     luaL_newlib(L, component_meta_funcs);
     lua_setfield(L,-2,"__index");
 
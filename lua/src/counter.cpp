@@ -9,10 +9,10 @@ bool discover_callback(table_ptr tp,hpx::performance_counters::counter_info cons
   (subtp->t)["fullname_"].var = c.fullname_;
   (subtp->t)["helptext_"].var = c.helptext_;
   (subtp->t)["unit_of_measure_"].var = c.unit_of_measure_;
-  (subtp->t)["version_"].var = c.version_;
-  (subtp->t)["type_"].var = c.type_;
-  (subtp->t)["status_"].var = c.status_;
-  (tp->t)[tp->size++].var = subtp;
+  (subtp->t)["version_"].var = std::int64_t(c.version_);
+  (subtp->t)["type_"].var = std::int64_t(c.type_);
+  (subtp->t)["status_"].var = std::int64_t(c.status_);
+  (tp->t)[std::int64_t(tp->t.array_size()+1)].var = subtp;
   return true;
 }
 
@@ -48,8 +48,8 @@ int xlua_get_value(lua_State *L) {
     (tp->t)["count_"].var = value.count_;
     (tp->t)["value_"].var = value.value_;
     (tp->t)["scaling_"].var = value.scaling_;
-    (tp->t)["status_"].var = value.status_;
-    (tp->t)["scale_inverse_"].var = value.scale_inverse_;
+    (tp->t)["status_"].var = std::int64_t(value.status_);
+    (tp->t)["scale_inverse_"].var = lua_bool(value.scale_inverse_);
     return 1;
   }
   return 0;
@@ -78,7 +78,6 @@ int xlua_stop(lua_State *L) {
 int discover(lua_State *L) {
   new_table(L);
   table_ptr& tp = *(table_ptr *)lua_touserdata(L,-1);
-  tp->size = 1;
   hpx::performance_counters::discover_counter_types(boost::bind(discover_callback,tp,_1,_2));
   return 1;
 }
@@ -0,0 +1,102 @@
+--Native copies of table_t and vector_t,
+--and frozen values. Prints a line for
+--anything that does not work as expected.
+
+--to_lua: a native copy that Lua indexes
+--without calling into C
+t = table_t.new()
+t[1] = 10
+t[2] = 20
+t.name = 'grid'
+t[true] = 'yes'
+lt = t:to_lua()
+if lt[1] ~= 10 or lt[2] ~= 20 or lt.name ~= 'grid' or lt[true] ~= 'yes' then
+  print('to_lua: wrong contents')
+end
+lt[1] = 11
+if t[1] ~= 10 then
+  print('to_lua: not a copy')
+end
+
+--from_lua: back into the same table_t,
+--or into a new one
+table_t.from_lua(lt,t)
+if t[1] ~= 11 or t.name ~= 'grid' then
+  print('from_lua: not written back')
+end
+t2 = table_t.from_lua({5,6,7,x=8})
+if t2[3] ~= 7 or t2.x ~= 8 then
+  print('from_lua: wrong new table_t')
+end
+if pcall(table_t.from_lua,{[{}]=1}) then
+  print('from_lua: accepted a table as key')
+end
+
+--Tables stored in a table_t are shared
+t.list = {1,2,3}
+t.list[1] = 100
+if t.list[1] ~= 100 then
+  print('stored table is not shared')
+end
+
+--with_local: f works on a native copy,
+--which is written back afterwards
+sum = table_t.with_local(t,function(lt)
+  lt[2] = lt[2] + 1
+  return lt[1] + lt[2]
+end)
+if sum ~= 32 or t[2] ~= 21 then
+  print('with_local: wrong result')
+end
+
+--The same for vector_t
+v = vector_t.new()
+for i=1,4 do
+  v[i] = i*0.5
+end
+lv = v:to_lua()
+if #lv ~= 4 or lv[4] ~= 2 then
+  print('vector to_lua: wrong contents')
+end
+vector_t.with_local(v,function(lv)
+  for i=1,#lv do
+    lv[i] = lv[i]*2
+  end
+end)
+if v[1] ~= 1 or v[4] ~= 4 then
+  print('vector with_local: not written back')
+end
+v2 = vector_t.from_lua({1,2,3})
+if v2[3] ~= 3 then
+  print('vector from_lua: wrong contents')
+end
+if pcall(vector_t.from_lua,{1,'x',3}) then
+  print('vector from_lua: accepted a string')
+end
+if pcall(vector_t.from_lua,{1,nil,3}) then
+  print('vector from_lua: accepted a hole')
+end
+
+--freeze: the value can no longer change,
+--and is sent to other localities by hash
+table_t.freeze(t)
+if pcall(function() t[1] = 0 end) then
+  print('freeze: frozen table_t was modified')
+end
+if pcall(table_t.with_local,t,function(lt) end) then
+  print('freeze: with_local on a frozen table_t')
+end
+vector_t.freeze(v)
+if pcall(function() v[1] = 0 end) then
+  print('freeze: frozen vector_t was modified')
+end
+
+function first(t)
+  return t[1]
+end
+HPX_PLAIN_ACTION('first')
+for _,loc in ipairs(find_all_localities()) do
+  if async(loc,'first',t):Get() ~= 11 then
+    print('frozen table_t not received')
+  end
+end
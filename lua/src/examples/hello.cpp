@@ -10,6 +10,10 @@
 
 int main() {
 
+  // Optional: build the Lua VMs for every worker
+  // up front instead of on first use.
+  hpx::prewarm_lua_vms();
+
   // Access to LUA in HPX is managed
   // through the hpx::LuaEnv class.
   // This should ideally be short lived.
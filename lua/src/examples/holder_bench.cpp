@@ -0,0 +1,92 @@
+#include <hpx/hpx_main.hpp>
+#include <hpx/runtime/serialization/serialize.hpp>
+#include <xlua.hpp>
+#include <chrono>
+
+/**
+ * Compares the Holder wire format with the
+ * plain boost::variant serialization it
+ * replaced, for typical argument lists.
+ * Reports bytes and nanoseconds per
+ * encode/decode round trip.
+ */
+
+typedef std::vector<hpx::variant_type> legacy_type;
+
+template<typename T>
+void bench(const char *name,const T& in,int iters) {
+  std::size_t bytes = 0;
+#ifdef XLUA_COUNT_HOLDERS
+  hpx::holder_stats before = hpx::get_holder_stats();
+#endif
+  auto start = std::chrono::high_resolution_clock::now();
+  for(int i=0;i<iters;i++) {
+    std::vector<char> buf;
+    {
+      hpx::serialization::output_archive oa(buf);
+      oa << in;
+      bytes = oa.bytes_written();
+    }
+    T out;
+    hpx::serialization::input_archive ia(buf,buf.size());
+    ia >> out;
+  }
+  auto stop = std::chrono::high_resolution_clock::now();
+  double ns = std::chrono::duration<double,std::nano>(stop-start).count();
+  std::cout << name << ": " << bytes << " bytes/op, "
+    << (ns/iters) << " ns/op" << std::endl;
+#ifdef XLUA_COUNT_HOLDERS
+  hpx::holder_stats after = hpx::get_holder_stats();
+  std::cout << "    Holder copies/op: " << double(after.copies-before.copies)/iters
+    << ", moves/op: " << double(after.moves-before.moves)/iters << std::endl;
+#endif
+}
+
+void run(const char *name,const hpx::array_type& args,int iters) {
+  legacy_type legacy;
+  for(auto i=args.begin();i != args.end();++i)
+    legacy.push_back(i->var);
+  std::cout << name << std::endl;
+  bench("  legacy variant",legacy,iters);
+  bench("  holder",args,iters);
+}
+
+int main() {
+  const int iters = 100000;
+
+  hpx::array_type ints;
+  for(int i=0;i<8;i++) {
+    hpx::Holder h;
+    h.set(double(i*10));
+    ints.push_back(h);
+  }
+  run("8 small integers",ints,iters);
+
+  hpx::array_type reals;
+  for(int i=0;i<8;i++) {
+    hpx::Holder h;
+    h.set(i+0.5);
+    reals.push_back(h);
+  }
+  run("8 doubles",reals,iters);
+
+  hpx::array_type strs;
+  for(int i=0;i<8;i++) {
+    hpx::Holder h;
+    h.set("key");
+    strs.push_back(h);
+  }
+  run("8 short strings",strs,iters);
+
+  hpx::array_type mixed;
+  for(int i=0;i<4;i++) {
+    hpx::Holder n, s;
+    n.set(double(i));
+    s.set("done");
+    mixed.push_back(n);
+    mixed.push_back(s);
+  }
+  run("4 integers and 4 strings",mixed,iters);
+
+  return 0;
+}
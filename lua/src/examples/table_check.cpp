@@ -0,0 +1,107 @@
+#include <hpx/hpx_main.hpp>
+#include <hpx/runtime/serialization/serialize.hpp>
+#include <xlua.hpp>
+#include <random>
+
+/**
+ * Checks table_type against a std::map
+ * holding the same keys: mixed key types,
+ * growth of both parts, and integer keys
+ * that move from the hash part into the
+ * array part as the array part grows.
+ * Prints "ok" or the first failure.
+ */
+
+typedef std::map<hpx::key_type,double> reference_type;
+
+int failures = 0;
+
+void check(bool ok,const char *what,int round) {
+  if(!ok && failures++ == 0)
+    std::cout << "FAILED: " << what << " (round " << round << ")" << std::endl;
+}
+
+double value_of(hpx::Holder& h) {
+  return boost::get<double>(h.var);
+}
+
+// Every key is found with its value, iteration visits each key once,
+// and the array part holds exactly the keys 1..n
+void compare(hpx::table_type& t,const reference_type& ref,int round) {
+  for(auto i=ref.begin();i != ref.end();++i) {
+    auto search = t.find(i->first);
+    check(search != t.end(),"key not found",round);
+    if(search != t.end())
+      check(value_of(search->second) == i->second,"wrong value",round);
+  }
+  std::set<hpx::key_type> visited;
+  for(auto i=t.begin();i != t.end();++i) {
+    check(ref.count(i->first) == 1,"unknown key visited",round);
+    check(visited.insert(i->first).second,"key visited twice",round);
+  }
+  check(visited.size() == ref.size(),"key not visited",round);
+  check(t.size() == ref.size(),"wrong size",round);
+  std::size_t n = 0;
+  while(ref.count(hpx::key_type(std::int64_t(n+1))) > 0)
+    n++;
+  check(t.array_size() == n,"wrong array part",round);
+}
+
+// Keys n+2, n+3, ... go to the hash part; setting n+1 must pull
+// all of them into the array part
+void check_migration() {
+  hpx::table_type t;
+  reference_type ref;
+  for(std::int64_t k=10;k >= 2;k--) {
+    t[hpx::key_type(k)].var = double(k);
+    ref[hpx::key_type(k)] = double(k);
+  }
+  check(t.array_size() == 0,"array part before migration",-1);
+  t[hpx::key_type(std::int64_t(1))].var = 1.0;
+  ref[hpx::key_type(std::int64_t(1))] = 1.0;
+  check(t.array_size() == 10,"array part after migration",-1);
+  compare(t,ref,-1);
+}
+
+void check_serialization(hpx::table_type& t,const reference_type& ref,int round) {
+  std::vector<char> buf;
+  {
+    hpx::serialization::output_archive oa(buf);
+    oa << t;
+  }
+  hpx::table_type out;
+  hpx::serialization::input_archive ia(buf,buf.size());
+  ia >> out;
+  compare(out,ref,round);
+}
+
+int main() {
+  check_migration();
+
+  std::mt19937 rng(1);
+  for(int round=0;round < 200 && failures == 0;round++) {
+    hpx::table_type t;
+    reference_type ref;
+    for(int op=0;op < 2000;op++) {
+      hpx::key_type k;
+      switch(rng() % 5) {
+        case 0: k = std::int64_t(rng() % 300) - 20; break;
+        case 1: k = hpx::atom("s" + std::to_string(rng() % 200)); break;
+        case 2: k = double(rng() % 100) + 0.5; break;
+        case 3: k = hpx::lua_bool(rng() % 2 == 0); break;
+        default: k = std::int64_t(t.array_size() + 1 + rng() % 3); break;
+      }
+      double v = rng() % 1000;
+      t[k].var = v;
+      ref[k] = v;
+      if(op % 97 == 0)
+        compare(t,ref,round);
+    }
+    compare(t,ref,round);
+    check_serialization(t,ref,round);
+  }
+
+  if(failures == 0)
+    std::cout << "ok" << std::endl;
+  return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,39 @@
+#include <hpx/hpx_main.hpp>
+#include <xlua.hpp>
+#include <chrono>
+
+/**
+ * Measures how long it takes to build a
+ * Lua VM the way the pool does, next to a
+ * bare lua_State with the standard
+ * libraries, which is the part of the
+ * setup every VM has to repeat.
+ * Reports microseconds per VM.
+ */
+
+template<typename F>
+void bench(const char *name,F make,int iters) {
+  auto start = std::chrono::high_resolution_clock::now();
+  for(int i=0;i<iters;i++)
+    make();
+  auto stop = std::chrono::high_resolution_clock::now();
+  double us = std::chrono::duration<double,std::micro>(stop-start).count();
+  std::cout << name << ": " << (us/iters) << " us/VM" << std::endl;
+}
+
+int main() {
+  const int iters = 1000;
+
+  // The first VM also builds the template
+  delete new hpx::Lua();
+
+  bench("luaL_newstate + luaL_openlibs",[]() {
+    lua_State *L = luaL_newstate();
+    luaL_openlibs(L);
+    lua_close(L);
+  },iters);
+  bench("hpx::Lua",[]() {
+    delete new hpx::Lua();
+  },iters);
+  return 0;
+}
@@ -502,6 +502,7 @@ int hpx_startup::user_main (int argc, char **argv) {
   if(connect_flag) {
     hpx::register_shutdown_function(stop_monitor);
   }
+  hpx::prewarm_lua_vms();
   auto ts = std::chrono::high_resolution_clock::now();
   int status, result;
   hpx::LuaEnv lenv;
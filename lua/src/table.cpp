@@ -25,15 +25,10 @@ int hpx_table_iter_call(lua_State *L) {
     table_iter_type *fnc = (table_iter_type *)lua_touserdata(L,1);
     if(fnc->ready && fnc->begin != fnc->end) {
 
-      key_type kt = fnc->begin->first;
-      if(kt.which() == 0)
-        lua_pushnumber(L,boost::get<double>(kt));
-      else
-        lua_pushstring(L,boost::get<std::string>(kt).c_str());
+      push_key(L,fnc->begin->first);
       lua_replace(L,2);
 
-      Holder h = fnc->begin->second;
-      h.unpack(L);
+      fnc->begin->second.unpack(L);
       lua_replace(L,3);
 
       ++fnc->begin;
@@ -58,6 +53,7 @@ int open_table_iter(lua_State *L) {
     luaL_newlib(L,table_iter_funcs);
 
     luaL_newmetatable(L,table_iter_metatable_name);
+    tag_metatable(L,table_iter_metatable_name);
     luaL_newlib(L, table_iter_meta_funcs);
     lua_setfield(L,-2,"__index");
 
@@ -99,9 +95,8 @@ int linspace(lua_State *L) {
   table_ptr& t = *(table_ptr*)table;
   double delta = (hi-lo)/(sz-1);
   for(int i=1;i<=sz;i++) {
-    (t->t)[i].var = lo + (i-1)*delta;
+    (t->t)[std::int64_t(i)].var = lo + (i-1)*delta;
   }
-  t->size=sz;
   return 1;
 }
 
@@ -117,9 +112,7 @@ int table_len(lua_State *L) {
     if(cmp_meta(L,-1,table_metatable_name)) {
       table_ptr *fnc_p = (table_ptr *)lua_touserdata(L,-1);
       table_ptr& fnc = *fnc_p;
-      int sz = fnc->size;
-      //if(sz == 0) sz = fnc->t.size();
-      lua_pushnumber(L,sz);
+      lua_pushinteger(L,fnc->t.array_size());
     }
     return 1;
 }
@@ -136,11 +129,10 @@ int table_clos_iter(lua_State *L) {
   table_ptr& fnc = *fnc_p;
   lua_pop(L,lua_gettop(L));
   lua_pushnumber(L,next_index);
-  auto ptr = fnc->t.find(next_index);
+  auto ptr = fnc->t.find(std::int64_t(next_index));
   if(ptr == fnc->t.end())
     return 0;
-  Holder h = (fnc->t)[next_index];
-  h.unpack(L);
+  ptr->second.unpack(L);
   return 2;
 }
 
@@ -164,55 +156,209 @@ int table_ipairs(lua_State *L) {
 }
 
 void push_key(lua_State *L,const key_type& kt) {
-  if(kt.which() == 0) {
-    lua_pushnumber(L,boost::get<double>(kt));
-  } else {
-    lua_pushstring(L,boost::get<std::string>(kt).c_str());
+  switch(kt.which()) {
+    case num_key:
+      lua_pushnumber(L,boost::get<double>(kt));
+      break;
+    case str_key:
+      {
+        const std::string& s = boost::get<atom>(kt).str();
+        lua_pushlstring(L,s.data(),s.size());
+      }
+      break;
+    case int_key:
+      lua_pushinteger(L,boost::get<std::int64_t>(kt));
+      break;
+    case bool_key:
+      lua_pushboolean(L,boost::get<lua_bool>(kt).value);
+      break;
   }
 }
 
+/**
+ * table_t.freeze(t) makes t, and the tables and vectors in it,
+ * immutable, so calls on other localities receive it by hash.
+ * Returns t.
+ */
+int table_freeze(lua_State *L) {
+  if(!cmp_meta(L,1,table_metatable_name))
+    return 0;
+  Holder h;
+  h.var = *(table_ptr *)lua_touserdata(L,1);
+  freeze_value(h);
+  lua_settop(L,1);
+  return 1;
+}
+
 int table_name(lua_State *L) {
   lua_pushstring(L,table_metatable_name);
   return 1;
 }
 
+// True if the Lua value at index can be a key of a table_t: a number
+// other than NaN, a string or a boolean
+bool table_key_ok(lua_State *L,int index) {
+  switch(lua_type(L,index)) {
+    case LUA_TNUMBER:
+      return lua_tonumber(L,index) == lua_tonumber(L,index);
+    case LUA_TSTRING:
+    case LUA_TBOOLEAN:
+      return true;
+    default:
+      return false;
+  }
+}
+
+const char *const bad_key_msg = "table_t keys must be numbers, strings or booleans";
+
+// The entry of t for the Lua key at index, added if missing. The key
+// must pass table_key_ok().
+Holder& table_value(lua_State *L,table_type& t,int index) {
+  if(lua_isnumber(L,index))
+    return t[lua_number_key(L,index)];
+  if(lua_isboolean(L,index))
+    return t[lua_bool(lua_toboolean(L,index) != 0)];
+  return t[lua_atom(L,index)];
+}
+
+/**
+ * t:to_lua() or table_t.to_lua(t) copies t into a native Lua table,
+ * which Lua indexes without calling into C. The tables and vectors
+ * held in t are not copied, they stay table_t and vector_t.
+ */
+int table_to_lua(lua_State *L) {
+  if(!cmp_meta(L,1,table_metatable_name))
+    return 0;
+  table_ptr t = *(table_ptr *)lua_touserdata(L,1);
+  const std::size_t n = t->t.array_size();
+  lua_createtable(L,(int)n,(int)(t->t.size()-n));
+  unpack_memo memo;
+  for(auto i=t->t.begin();i != t->t.end();++i) {
+    if(i->second.var.which() == Holder::empty_t)
+      continue;
+    push_key(L,i->first);
+    i->second.unpack(L,&memo);
+    lua_rawset(L,-3);
+  }
+  return 1;
+}
+
+/**
+ * table_t.from_lua(lt) copies the native Lua table lt into a new
+ * table_t. table_t.from_lua(lt,t) replaces the contents of the
+ * table_t t instead, writing back a copy made with to_lua().
+ * Returns the table_t.
+ */
+int table_from_lua(lua_State *L) {
+  luaL_checktype(L,1,LUA_TTABLE);
+  if(cmp_meta(L,2,table_metatable_name)) {
+    if((*(table_ptr *)lua_touserdata(L,2))->frozen != 0)
+      return luaL_error(L,"table_t is frozen");
+    lua_settop(L,2);
+  } else {
+    lua_settop(L,1);
+    new_table(L);
+  }
+  bool bad_key = false;
+  {
+    // Scoped so nothing is left to destroy when the error is raised
+    table_type t;
+    pack_memo memo;
+    // Lua visits 1..n first and in order, so they go to the array part
+    lua_pushnil(L);
+    while(lua_next(L,1) != 0) {
+      if(!table_key_ok(L,-2)) {
+        lua_pop(L,2);
+        bad_key = true;
+        break;
+      }
+      Holder h;
+      h.pack(L,-1,&memo);
+      table_value(L,t,-2) = std::move(h);
+      lua_pop(L,1);
+    }
+    if(!bad_key)
+      (*(table_ptr *)lua_touserdata(L,2))->t = std::move(t);
+  }
+  if(bad_key)
+    return luaL_argerror(L,1,bad_key_msg);
+  return 1;
+}
+
+/**
+ * table_t.with_local(t,f) calls f with a native copy of t, as made by
+ * to_lua(), then writes the copy back into t. Returns what f returns.
+ */
+int table_with_local(lua_State *L) {
+  if(!cmp_meta(L,1,table_metatable_name))
+    return 0;
+  if((*(table_ptr *)lua_touserdata(L,1))->frozen != 0)
+    return luaL_error(L,"table_t is frozen");
+  luaL_checktype(L,2,LUA_TFUNCTION);
+  lua_settop(L,2);
+  table_to_lua(L);
+  lua_pushvalue(L,2);
+  lua_pushvalue(L,3);
+  lua_call(L,1,LUA_MULTRET);
+  const int nresults = lua_gettop(L)-3;
+  lua_pushcfunction(L,lua_packing<table_from_lua>);
+  lua_pushvalue(L,3);
+  lua_pushvalue(L,1);
+  lua_call(L,2,0);
+  return nresults;
+}
+
 int table_new_index(lua_State *L) {
   table_ptr *fnc_p = (table_ptr *)lua_touserdata(L,1);
   table_ptr& fnc = *fnc_p;
+  if(!table_key_ok(L,2)) {
+    // Reading t[nil] gives nil, as for a native table
+    if(lua_gettop(L) != 3 && lua_isnil(L,2))
+      return 0;
+    return luaL_argerror(L,2,bad_key_msg);
+  }
   Holder h;
   if(lua_gettop(L)==3) { // set
+    if(fnc->frozen != 0)
+      return luaL_error(L,"table_t is frozen");
     h.pack(L,3);
-    if(lua_isnumber(L,2)) {
-      double key = lua_tonumber(L,2);
-      (fnc->t)[key] = h;
-      if(key == 1 + fnc->size)
-        fnc->size = key;
-    } else {
-      std::string key = lua_tostring(L,2);
-      (fnc->t)[key] = h;
-    }
+    table_value(L,fnc->t,2) = std::move(h);
     return 0;
   } else {// get
+    Holder *found = nullptr;
     if(lua_isnumber(L,2)) {
-      double key = lua_tonumber(L,2);
-      auto ptr = fnc->t.find(key);
+      auto ptr = fnc->t.find(lua_number_key(L,2));
+      if(ptr == fnc->t.end())
+        return 0;
+      found = &ptr->second;
+    } else if(lua_isboolean(L,2)) {
+      auto ptr = fnc->t.find(lua_bool(lua_toboolean(L,2) != 0));
       if(ptr == fnc->t.end())
         return 0;
-      h = ptr->second;
+      found = &ptr->second;
     } else {
-      std::string key = lua_tostring(L,2);
-      if(key == "Name") {
+      static const atom name_atom("Name");
+      atom key = lua_atom(L,2);
+      if(key == name_atom) {
         lua_pop(L,2);
         lua_pushcfunction(L,table_name);
         return 1;
       }
       auto ptr = fnc->t.find(key);
-      if(ptr == fnc->t.end())
+      if(ptr == fnc->t.end()) {
+        // t:to_lua(), unless t has a field of that name
+        static const atom to_lua_atom("to_lua");
+        if(key == to_lua_atom) {
+          lua_pop(L,2);
+          lua_pushcfunction(L,table_to_lua);
+          return 1;
+        }
         return 0;
-      h = ptr->second;
+      }
+      found = &ptr->second;
     }
     lua_pop(L,2);
-    h.unpack(L);
+    found->unpack(L);
   }
   return 1;
 }
@@ -225,12 +371,17 @@ int open_table(lua_State *L) {
     static const struct luaL_Reg table_funcs [] = {
         {"new", &new_table},
         {"linspace", &linspace},
+        {"freeze", &table_freeze},
+        {"to_lua", &table_to_lua},
+        {"from_lua", &lua_packing<table_from_lua>},
+        {"with_local", &table_with_local},
         {NULL, NULL}
     };
 
     luaL_newlib(L,table_funcs);
 
     luaL_newmetatable(L,table_metatable_name);
+    tag_metatable(L,table_metatable_name);
     //luaL_newlib(L, table_meta_funcs);
     //lua_setfield(L,-2,"__index");
 
@@ -243,11 +394,11 @@ int open_table(lua_State *L) {
     lua_settable(L,-3);
 
     lua_pushstring(L,"__newindex");
-    lua_pushcfunction(L,table_new_index);
+    lua_pushcfunction(L,lua_packing<table_new_index>);
     lua_settable(L,-3);
 
     lua_pushstring(L,"__index");
-    lua_pushcfunction(L,table_new_index);
+    lua_pushcfunction(L,lua_packing<table_new_index>);
     lua_settable(L,-3);
 
     lua_pushstring(L,"__pairs");
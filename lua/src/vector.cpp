@@ -6,7 +6,7 @@ namespace hpx {
 int new_vector(lua_State *L) {
   size_t nbytes = sizeof(vector_ptr);
   char *vector = (char *)lua_newuserdata(L,nbytes);
-  new (vector) vector_ptr(new std::vector<double>());
+  new (vector) vector_ptr(new vector_data());
   luaL_setmetatable(L,vector_metatable_name);
   return 1;
 }
@@ -18,10 +18,10 @@ int vlinspace(lua_State *L) {
   size_t nbytes = sizeof(table_ptr);
   char *vector = (char *)lua_newuserdata(L,nbytes);
   luaL_setmetatable(L,vector_metatable_name);
-  new (vector) vector_ptr(new std::vector<double>());
+  new (vector) vector_ptr(new vector_data());
   vector_ptr& v = *(vector_ptr*)vector;
   if(v->size() < sz+1)
-    v->resize(sz+1);
+    v->resize(sz+1,0.0);
   double delta = (hi-lo)/(sz-1);
   for(int i=1;i<=sz;i++) {
     (*v)[i] = lo + (i-1)*delta;
@@ -69,6 +69,99 @@ int vector_ipairs(lua_State *L) {
   return 1;
 }
 
+/**
+ * vector_t.freeze(v) makes v immutable, so calls on other
+ * localities receive it by hash. Returns v.
+ */
+int vector_freeze(lua_State *L) {
+  if(!cmp_meta(L,1,vector_metatable_name))
+    return 0;
+  Holder h;
+  h.var = *(vector_ptr *)lua_touserdata(L,1);
+  freeze_value(h);
+  lua_settop(L,1);
+  return 1;
+}
+
+/**
+ * v:to_lua() or vector_t.to_lua(v) copies v into a native Lua array,
+ * which Lua indexes without calling into C.
+ */
+int vector_to_lua(lua_State *L) {
+  if(!cmp_meta(L,1,vector_metatable_name))
+    return 0;
+  vector_ptr& v = *(vector_ptr *)lua_touserdata(L,1);
+  const int n = v->size() > 0 ? int(v->size()-1) : 0;
+  lua_createtable(L,n,0);
+  for(int i=1;i<=n;i++) {
+    lua_pushnumber(L,(*v)[i]);
+    lua_rawseti(L,-2,i);
+  }
+  return 1;
+}
+
+/**
+ * vector_t.from_lua(lt) copies the numbers lt[1..#lt] into a new
+ * vector_t. vector_t.from_lua(lt,v) replaces the contents of the
+ * vector_t v instead, writing back a copy made with to_lua().
+ * Returns the vector_t. Raises an error if lt[1..#lt] holds anything
+ * but numbers, including a hole.
+ */
+int vector_from_lua(lua_State *L) {
+  luaL_checktype(L,1,LUA_TTABLE);
+  if(cmp_meta(L,2,vector_metatable_name)) {
+    if((*(vector_ptr *)lua_touserdata(L,2))->frozen != 0)
+      return luaL_error(L,"vector_t is frozen");
+    lua_settop(L,2);
+  } else {
+    lua_settop(L,1);
+    new_vector(L);
+  }
+  vector_ptr& v = *(vector_ptr *)lua_touserdata(L,2);
+  const std::size_t n = lua_rawlen(L,1);
+  // Checked before v is changed, so an error leaves it as it was
+  for(std::size_t i=1;i<=n;i++) {
+    lua_rawgeti(L,1,i);
+    if(!lua_isnumber(L,-1)) {
+      const char *msg = lua_pushfstring(L,"number expected at index %d, got %s",
+        (int)i,luaL_typename(L,-2));
+      return luaL_argerror(L,1,msg);
+    }
+    lua_pop(L,1);
+  }
+  v->resize(n > 0 ? n+1 : 0,0.0);
+  for(std::size_t i=1;i<=n;i++) {
+    lua_rawgeti(L,1,i);
+    (*v)[i] = lua_tonumber(L,-1);
+    lua_pop(L,1);
+  }
+  return 1;
+}
+
+/**
+ * vector_t.with_local(v,f) calls f with a native copy of v, as made
+ * by to_lua(), then writes the copy back into v. Returns what f
+ * returns.
+ */
+int vector_with_local(lua_State *L) {
+  if(!cmp_meta(L,1,vector_metatable_name))
+    return 0;
+  if((*(vector_ptr *)lua_touserdata(L,1))->frozen != 0)
+    return luaL_error(L,"vector_t is frozen");
+  luaL_checktype(L,2,LUA_TFUNCTION);
+  lua_settop(L,2);
+  vector_to_lua(L);
+  lua_pushvalue(L,2);
+  lua_pushvalue(L,3);
+  lua_call(L,1,LUA_MULTRET);
+  const int nresults = lua_gettop(L)-3;
+  lua_pushcfunction(L,vector_from_lua);
+  lua_pushvalue(L,3);
+  lua_pushvalue(L,1);
+  lua_call(L,2,0);
+  return nresults;
+}
+
 int vector_name(lua_State *L) {
   lua_pushstring(L,vector_metatable_name);
   return 1;
@@ -77,6 +170,8 @@ int vector_name(lua_State *L) {
 int vector_pop(lua_State *L) {
   vector_ptr *fnc_p = (vector_ptr *)lua_touserdata(L,1);
   vector_ptr& fnc = *fnc_p;
+  if(fnc->frozen != 0)
+    return luaL_error(L,"vector_t is frozen");
   lua_pop(L,lua_gettop(L));
   int n = fnc->size()-1;
   if(n < 1)
@@ -90,20 +185,31 @@ int vector_new_index(lua_State *L) {
   vector_ptr *fnc_p = (vector_ptr *)lua_touserdata(L,1);
   vector_ptr& fnc = *fnc_p;
   if(lua_gettop(L)==3) { // set
-    int key = lua_tonumber(L,2);
+    if(fnc->frozen != 0)
+      return luaL_error(L,"vector_t is frozen");
+    // lua_tointeger() would turn 1.5 into 1 or 0, and a negative
+    // key would be written before the start of the vector
+    lua_Number d = luaL_checknumber(L,2);
+    if(!(d >= 0 && d < 9007199254740992.0) || d != std::floor(d))
+      return luaL_argerror(L,2,"index must be a non-negative integer");
+    std::size_t key = std::size_t(d);
     if(key >= fnc->size())
-      fnc->resize(key+1);
+      fnc->resize(key+1,0.0);
     (*fnc)[key] = lua_tonumber(L,3);
     return 0;
   } else { // get
     if(!lua_isnumber(L,2)) {
+      static const atom to_lua_atom("to_lua");
+      const bool to_lua = lua_type(L,2) == LUA_TSTRING && lua_atom(L,2) == to_lua_atom;
       lua_pop(L,lua_gettop(L));
-      lua_pushcfunction(L,vector_name);
+      lua_pushcfunction(L,to_lua ? vector_to_lua : vector_name);
       return 1;
     }
-    int key = lua_tonumber(L,2);
-    if(0 <= key && key < fnc->size()) {
-      lua_pushnumber(L,(*fnc)[key]);
+    // As for the setter, only non-negative integers are indices;
+    // v[1.5] is nil rather than whatever lua_tointeger() makes of it
+    lua_Number d = lua_tonumber(L,2);
+    if(d >= 0 && d < double(fnc->size()) && d == std::floor(d)) {
+      lua_pushnumber(L,(*fnc)[std::size_t(d)]);
     } else {
       lua_pushnil(L);
     }
@@ -120,12 +226,17 @@ int open_vector(lua_State *L) {
     static const struct luaL_Reg vector_funcs [] = {
         {"new", &new_vector},
         {"linspace", &vlinspace},
+        {"freeze", &vector_freeze},
+        {"to_lua", &vector_to_lua},
+        {"from_lua", &vector_from_lua},
+        {"with_local", &vector_with_local},
         {NULL, NULL}
     };
 
     luaL_newlib(L,vector_funcs);
 
     luaL_newmetatable(L,vector_metatable_name);
+    tag_metatable(L,vector_metatable_name);
     //luaL_newlib(L, vector_meta_funcs);
     //lua_setfield(L,-2,"__index");
 
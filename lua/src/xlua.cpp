@@ -1,6 +1,17 @@
 #include "xlua.hpp"
 #include "xlua_prototypes.hpp"
 #include <hpx/lcos/broadcast.hpp>
+#include <hpx/lcos/local/spinlock.hpp>
+#include <hpx/lcos/local/latch.hpp>
+#include <cstdlib>
+#include <cstring>
+#include <set>
+#include <list>
+#include <algorithm>
+#include <limits>
+#include <unordered_map>
+#include <mutex>
+#include <boost/weak_ptr.hpp>
 
 const int max_output_args = 10;
 
@@ -21,19 +32,21 @@ void show(std::ostream& o,Holder h) {
     o << "*nil*";
   } else if(w == Holder::num_t) {
     o << boost::get<double>(h.var);
+  } else if(w == Holder::int_t) {
+    o << boost::get<std::int64_t>(h.var);
+  } else if(w == Holder::bool_t) {
+    o << (boost::get<lua_bool>(h.var).value ? "true" : "false");
   } else if(w == Holder::str_t) {
     o << boost::get<std::string>(h.var);
+  } else if(w == Holder::shared_str_t) {
+    o << boost::get<shared_string_ptr>(h.var)->str();
   } else if(w == Holder::table_t) {
     table_ptr tp = boost::get<table_ptr>(h.var);
     o << "{";
     for(auto i = tp->t.begin();i != tp->t.end();++i) {
       if(i != tp->t.begin())
         o << ",";
-      key_type kt = i->first;
-      if(kt.which()==0)
-        o << boost::get<double>(kt);
-      else
-        o << boost::get<std::string>(kt);
+      o << i->first;
       o << "=";
       show(o,i->second);
     }
@@ -69,84 +82,54 @@ const char *lua_read(lua_State *L,void *data,size_t *size);
 int lua_write(lua_State *L,const char *str,unsigned long len,std::string *buf);
 bool cmp_meta(lua_State *L,int index,const char *meta_name);
 
-  Lua::Lua() : busy(true), L(luaL_newstate()) {
-    luaL_openlibs(L);
-    lua_pushcfunction(L,xlua_stop);
-    lua_setglobal(L,"stop");
-    lua_pushcfunction(L,xlua_start);
-    lua_setglobal(L,"start");
-    lua_pushcfunction(L,xlua_get_value);
-    lua_setglobal(L,"get_value");
-    lua_pushcfunction(L,xlua_get_counter);
-    lua_setglobal(L,"get_counter");
-    lua_pushcfunction(L,discover);
-    lua_setglobal(L,"discover_counter_types");
-    lua_pushcfunction(L,make_ready_future);
-    lua_setglobal(L,"make_ready_future");
-    lua_pushcfunction(L,dataflow);
-    lua_setglobal(L,"dataflow");
-    lua_pushcfunction(L,xlua_unwrapped);
-    lua_setglobal(L,"unwrapped");
-    lua_pushcfunction(L,call);
-    lua_setglobal(L,"call");
-    lua_pushcfunction(L,async);
-    lua_setglobal(L,"async");
-    lua_pushcfunction(L,vector_pop);
-    lua_setglobal(L,"vector_pop");
-    lua_pushcfunction(L,luax_wait_all);
-    lua_setglobal(L,"wait_all");
-    lua_pushcfunction(L,luax_when_all);
-    lua_setglobal(L,"when_all");
-    lua_pushcfunction(L,luax_when_any);
-    lua_setglobal(L,"when_any");
-    lua_pushcfunction(L,unwrap);
-    lua_setglobal(L,"unwrap");
-    lua_pushcfunction(L,isfuture);
-    lua_setglobal(L,"isfuture");
-    lua_pushcfunction(L,isvector);
-    lua_setglobal(L,"isvector");
-    lua_pushcfunction(L,islocality);
-    lua_setglobal(L,"islocality");
-    lua_pushcfunction(L,istable);
-    lua_setglobal(L,"istable");
-    lua_pushcfunction(L,hpx_reg);
-    lua_setglobal(L,"HPX_PLAIN_ACTION");
-    lua_pushcfunction(L,hpx_run);
-    lua_setglobal(L,"hpx_run");
-    lua_pushcfunction(L,luax_run_guarded);
-    lua_setglobal(L,"run_guarded");
-    lua_pushcfunction(L,find_here);
-    lua_setglobal(L,"find_here");
-    lua_pushcfunction(L,all_localities);
-    lua_setglobal(L,"find_all_localities");
-    lua_pushcfunction(L,remote_localities);
-    lua_setglobal(L,"find_remote_localities");
-    lua_pushcfunction(L,root_locality);
-    lua_setglobal(L,"find_root_locality");
-    lua_pushcfunction(L,apex_register_policy);
-    lua_setglobal(L,"apex_register_policy");
-
-    //open_hpx(L);
-    luaL_requiref(L, "hpx",&open_hpx, 1);
-    open_table(L);
-    luaL_requiref(L, "table_t", &open_table, 1);
-    luaL_requiref(L, "vector_t", &open_vector, 1);
-    open_table_iter(L);
-    luaL_requiref(L, "table_iter_t", &open_table_iter, 1);
-    open_future(L);
-    luaL_requiref(L, "future", &open_future, 1);
-    open_guard(L);
-    luaL_requiref(L, "guard",&open_guard, 1);
-    open_locality(L);
-    luaL_requiref(L, "locality",&open_locality, 1);
-    luaL_requiref(L, "component",&open_component, 1);
-    lua_pop(L,lua_gettop(L));
-
-    new_table(L);
-    table_ptr *tp = (table_ptr *)lua_touserdata(L,-1);
-    *tp = globals;
-    lua_setglobal(L,"globals");
-    luaL_dostring(L,
+//--- Registry key of the per-VM table of loaded functions by hash
+static char proto_cache_key;
+//--- Registry key of the per-VM weak table from function to its dump
+static char dump_cache_key;
+//--- Registry key of the Lua object that owns a VM
+static char lua_vm_key;
+//--- Registry key of the per-VM table from Lua string to atom
+static char atom_cache_key;
+//--- Registry key of the per-VM weak-valued table from the data
+//--- behind a table_t or vector_t to its userdata
+static char userdata_cache_key;
+
+//--- C functions installed as globals in every VM
+const luaL_Reg xlua_globals[] = {
+  {"stop",xlua_stop},
+  {"start",xlua_start},
+  {"get_value",xlua_get_value},
+  {"get_counter",xlua_get_counter},
+  {"discover_counter_types",discover},
+  {"make_ready_future",lua_packing<make_ready_future>},
+  {"dataflow",lua_packing<dataflow>},
+  {"unwrapped",xlua_unwrapped},
+  {"call",call},
+  {"async",lua_packing<async>},
+  {"vector_pop",vector_pop},
+  {"wait_all",luax_wait_all},
+  {"when_all",luax_when_all},
+  {"when_any",luax_when_any},
+  {"unwrap",unwrap},
+  {"isfuture",isfuture},
+  {"isvector",isvector},
+  {"islocality",islocality},
+  {"istable",istable},
+  {"HPX_PLAIN_ACTION",hpx_reg},
+  {"hpx_run",hpx_run},
+  {"run_guarded",luax_run_guarded},
+  {"find_here",find_here},
+  {"find_all_localities",all_localities},
+  {"find_remote_localities",remote_localities},
+  {"find_root_locality",root_locality},
+  {"apex_register_policy",apex_register_policy},
+  {"vm_pool_stats",xlua_pool_stats},
+  {"holder_stats",xlua_holder_stats},
+  {NULL,NULL}
+};
+
+//--- Lua helpers defined in every VM
+const char *xlua_init_source =
       " function for_each_s(i0,ihi,f)"
       "  local i"
       "  for i=i0,ihi do"
@@ -168,17 +151,93 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
       "    fs[#fs+1]=async(for_each_s,i0,ihi,f)"
       "  end"
       "  wait_all(fs)"
-      " end"
-  );
+      " end";
+
+//--- The part of VM setup that is prepared once: the init chunk
+//--- is compiled here and every VM after that only loads the
+//--- bytecode. Opening the standard libraries and the xlua modules
+//--- is still done per VM (see vm_bench for what that costs).
+struct LuaTemplate {
+  std::string init_chunk;
+  LuaTemplate() {
+    lua_State *L = luaL_newstate();
+    if(luaL_loadstring(L,xlua_init_source) != LUA_OK) {
+      SHOW_ERROR(L);
+    } else {
+      lua_dump(L,(lua_Writer)lua_write,&init_chunk);
+    }
+    lua_close(L);
+  }
+};
 
-    for(auto i=function_registry.begin();i != function_registry.end();++i) {
-      // Insert into table
-      if(lua_load(L,(lua_Reader)lua_read,(void *)&i->second,i->first.c_str(),"b") != 0) {
-        std::cout << "function " << i->first << " size=" << i->second.size() << std::endl;
-        SHOW_ERROR(L);
-      } else {
-        lua_setglobal(L,i->first.c_str());
-      }
+const LuaTemplate& lua_template() {
+  static LuaTemplate tmpl;
+  return tmpl;
+}
+
+int registry_index(lua_State *L);
+bool lua_lazy_functions();
+
+  Lua::Lua() : busy(true), L(luaL_newstate()), lazy_functions(lua_lazy_functions()) {
+    const LuaTemplate& tmpl = lua_template();
+    // Nothing created here is garbage, don't let the collector run
+    lua_gc(L,LUA_GCSTOP,0);
+    luaL_openlibs(L);
+    lua_pushglobaltable(L);
+    luaL_setfuncs(L,xlua_globals,0);
+    lua_pop(L,1);
+
+    //open_hpx(L);
+    luaL_requiref(L, "hpx",&open_hpx, 1);
+    luaL_requiref(L, "table_t", &open_table, 1);
+    luaL_requiref(L, "vector_t", &open_vector, 1);
+    luaL_requiref(L, "table_iter_t", &open_table_iter, 1);
+    luaL_requiref(L, "future", &open_future, 1);
+    luaL_requiref(L, "guard",&open_guard, 1);
+    luaL_requiref(L, "locality",&open_locality, 1);
+    luaL_requiref(L, "component",&open_component, 1);
+    lua_pop(L,lua_gettop(L));
+
+    new_table(L);
+    table_ptr *tp = (table_ptr *)lua_touserdata(L,-1);
+    *tp = globals;
+    lua_setglobal(L,"globals");
+    if(lua_load(L,(lua_Reader)lua_read,(void *)&tmpl.init_chunk,"=xlua_init","b") != LUA_OK
+        || lua_pcall(L,0,0,0) != LUA_OK) {
+      SHOW_ERROR(L);
+    }
+
+    // Registered functions are loaded by get_lua_ptr(), or
+    // in lazy mode by registry_index() the first time they're used
+    lua_newtable(L);
+    fn_cache_ref = luaL_ref(L,LUA_REGISTRYINDEX);
+    lua_newtable(L);
+    lua_rawsetp(L,LUA_REGISTRYINDEX,&proto_cache_key);
+    lua_newtable(L);
+    lua_createtable(L,0,1);
+    lua_pushstring(L,"k");
+    lua_setfield(L,-2,"__mode");
+    lua_setmetatable(L,-2);
+    lua_rawsetp(L,LUA_REGISTRYINDEX,&dump_cache_key);
+    lua_pushlightuserdata(L,this);
+    lua_rawsetp(L,LUA_REGISTRYINDEX,&lua_vm_key);
+    lua_newtable(L);
+    lua_rawsetp(L,LUA_REGISTRYINDEX,&atom_cache_key);
+    lua_newtable(L);
+    lua_createtable(L,0,1);
+    lua_pushstring(L,"v");
+    lua_setfield(L,-2,"__mode");
+    lua_setmetatable(L,-2);
+    lua_rawsetp(L,LUA_REGISTRYINDEX,&userdata_cache_key);
+    if(lazy_functions) {
+      lua_pushglobaltable(L);
+      lua_createtable(L,0,1);
+      lua_pushlightuserdata(L,this);
+      lua_pushcclosure(L,registry_index,1);
+      lua_setfield(L,-2,"__index");
+      lua_setmetatable(L,-2);
+      lua_pop(L,1);
+      synced_generation = function_table_generation.load();
     }
     /*
     luaL_dostring(L,
@@ -194,17 +253,253 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
 "  return t"
 "end");
 */
+    lua_gc(L,LUA_GCRESTART,0);
     busy = false;
   }
-  void Holder::unpack(lua_State *L) {
+unpack_memo::~unpack_memo() {
+  for(auto i=refs.begin();i != refs.end();++i)
+    luaL_unref(L,LUA_REGISTRYINDEX,i->second);
+}
+
+bool unpack_memo::push(lua_State *L_,const void *key) {
+  auto search = refs.find(key);
+  if(search == refs.end())
+    return false;
+  lua_rawgeti(L_,LUA_REGISTRYINDEX,search->second);
+  return true;
+}
+
+void unpack_memo::remember(lua_State *L_,const void *key) {
+  L = L_;
+  lua_pushvalue(L,-1);
+  refs[key] = luaL_ref(L,LUA_REGISTRYINDEX);
+}
+
+//--- Encoding used by stream_t. A table is its tag, a varint size
+//--- hint for the array part, then key/value pairs up to stream_end.
+//--- A table met again is written as stream_ref and the index of
+//--- its first occurrence, which keeps shared and cyclic tables.
+enum stream_tag {
+  stream_num, stream_int, stream_str, stream_true, stream_false,
+  stream_table, stream_end, stream_ref
+};
+const int stream_max_depth = 100;
+
+void stream_varint(std::string& out,std::uint64_t v) {
+  do {
+    unsigned char b = v & 0x7f;
+    v >>= 7;
+    if(v != 0) b |= 0x80;
+    out.push_back(b);
+  } while(v != 0);
+}
+
+bool unstream_varint(const char *&p,const char *end,std::uint64_t& v) {
+  v = 0;
+  for(int shift=0;shift < 64 && p < end;shift += 7) {
+    unsigned char b = *p++;
+    v |= std::uint64_t(b & 0x7f) << shift;
+    if((b & 0x80) == 0)
+      return true;
+  }
+  return false;
+}
+
+//--- Append the value at index to out. Returns false, leaving the
+//--- stack as it was, if it holds anything that is not plain data.
+bool stream_value(lua_State *L,int index,std::string& out,int depth,
+    std::map<const void *,std::uint64_t>& seen) {
+  switch(lua_type(L,index)) {
+    case LUA_TNUMBER:
+      {
+#if LUA_VERSION_NUM >= 503
+        if(lua_isinteger(L,index)) {
+          std::int64_t i = lua_tointeger(L,index);
+          out.push_back(stream_int);
+          stream_varint(out,(std::uint64_t(i) << 1) ^ std::uint64_t(i >> 63));
+          return true;
+        }
+        const bool integral = false; // floats stay floats
+#else
+        const bool integral = true;
+#endif
+        double d = lua_tonumber(L,index);
+        if(integral && d >= -9007199254740992.0 && d <= 9007199254740992.0 &&
+            d == double(std::int64_t(d)) && !(d == 0 && std::signbit(d))) {
+          std::int64_t i = std::int64_t(d);
+          out.push_back(stream_int);
+          stream_varint(out,(std::uint64_t(i) << 1) ^ std::uint64_t(i >> 63));
+        } else {
+          out.push_back(stream_num);
+          out.append((const char *)&d,sizeof(d));
+        }
+      }
+      return true;
+    case LUA_TSTRING:
+      {
+        size_t len;
+        const char *str = lua_tolstring(L,index,&len);
+        out.push_back(stream_str);
+        stream_varint(out,len);
+        out.append(str,len);
+      }
+      return true;
+    case LUA_TBOOLEAN:
+      out.push_back(lua_toboolean(L,index) ? stream_true : stream_false);
+      return true;
+    case LUA_TTABLE:
+      {
+        auto search = seen.find(lua_topointer(L,index));
+        if(search != seen.end()) {
+          out.push_back(stream_ref);
+          stream_varint(out,search->second);
+          return true;
+        }
+        if(depth >= stream_max_depth || !lua_checkstack(L,3))
+          return false;
+        const std::uint64_t id = seen.size();
+        seen[lua_topointer(L,index)] = id;
+        index = lua_absindex(L,index);
+        const int top = lua_gettop(L);
+        out.push_back(stream_table);
+        stream_varint(out,lua_rawlen(L,index));
+        lua_pushnil(L);
+        while(lua_next(L,index) != 0) {
+          if(!stream_value(L,-2,out,depth+1,seen) ||
+              !stream_value(L,-1,out,depth+1,seen)) {
+            lua_settop(L,top);
+            return false;
+          }
+          lua_pop(L,1);
+        }
+        out.push_back(stream_end);
+      }
+      return true;
+    default:
+      return false;
+  }
+}
+
+//--- Push the value encoded at p, advancing p past it. Tables are
+//--- also stored in the table at refs, in the order they are made.
+bool unstream_value(lua_State *L,const char *&p,const char *end,int refs,int& ntables) {
+  if(p >= end || !lua_checkstack(L,3))
+    return false;
+  std::uint64_t n;
+  switch(*p++) {
+    case stream_num:
+      {
+        double d;
+        if(end - p < (std::ptrdiff_t)sizeof(d))
+          return false;
+        std::memcpy(&d,p,sizeof(d));
+        p += sizeof(d);
+        lua_pushnumber(L,d);
+      }
+      return true;
+    case stream_int:
+      if(!unstream_varint(p,end,n))
+        return false;
+      lua_pushinteger(L,std::int64_t(n >> 1) ^ -std::int64_t(n & 1));
+      return true;
+    case stream_str:
+      if(!unstream_varint(p,end,n) || std::uint64_t(end - p) < n)
+        return false;
+      lua_pushlstring(L,p,n);
+      p += n;
+      return true;
+    case stream_true:
+      lua_pushboolean(L,1);
+      return true;
+    case stream_false:
+      lua_pushboolean(L,0);
+      return true;
+    case stream_table:
+      if(!unstream_varint(p,end,n))
+        return false;
+      lua_createtable(L,n,0);
+      lua_pushvalue(L,-1);
+      lua_rawseti(L,refs,++ntables);
+      while(p < end && *p != stream_end) {
+        if(!unstream_value(L,p,end,refs,ntables))
+          return false;
+        if(!unstream_value(L,p,end,refs,ntables)) {
+          lua_pop(L,1);
+          return false;
+        }
+        lua_rawset(L,-3);
+      }
+      if(p >= end)
+        return false;
+      p++;
+      return true;
+    case stream_ref:
+      if(!unstream_varint(p,end,n) || n >= std::uint64_t(ntables))
+        return false;
+      lua_rawgeti(L,refs,n+1);
+      return true;
+    default:
+      return false;
+  }
+}
+
+//--- Push the userdata this VM already has for the table_t or
+//--- vector_t data, if it has one. The userdata holds a reference to
+//--- data, so the address cannot be reused while the entry exists.
+bool push_cached_userdata(lua_State *L,const void *data) {
+  lua_rawgetp(L,LUA_REGISTRYINDEX,&userdata_cache_key);
+  if(!lua_istable(L,-1)) {
+    lua_pop(L,1);
+    return false;
+  }
+  lua_rawgetp(L,-1,data);
+  if(lua_isuserdata(L,-1)) {
+    lua_remove(L,-2);
+    return true;
+  }
+  lua_pop(L,2);
+  return false;
+}
+
+//--- Remember the userdata at index as the one for data
+void cache_userdata(lua_State *L,int index,const void *data) {
+  index = lua_absindex(L,index);
+  lua_rawgetp(L,LUA_REGISTRYINDEX,&userdata_cache_key);
+  if(lua_istable(L,-1)) {
+    lua_pushvalue(L,index);
+    lua_rawsetp(L,-2,data);
+  }
+  lua_pop(L,1);
+}
+
+  void Holder::unpack(lua_State *L,unpack_memo *memo) {
+    // Only lists and closures can reach the same data twice, so only
+    // they need a memo when the caller has none
+    if(memo == nullptr && (var.which() == ptr_t || var.which() == closure_t)) {
+      unpack_memo local_memo;
+      unpack(L,&local_memo);
+      return;
+    }
     if(var.which() == num_t) {
       lua_pushnumber(L,boost::get<double>(var));
+    } else if(var.which() == int_t) {
+      lua_pushinteger(L,boost::get<std::int64_t>(var));
+    } else if(var.which() == bool_t) {
+      lua_pushboolean(L,boost::get<lua_bool>(var).value);
     } else if(var.which() == str_t) {
-      lua_pushstring(L,boost::get<std::string>(var).c_str());
+      const std::string& str = boost::get<std::string>(var);
+      lua_pushlstring(L,str.data(),str.size());
+    } else if(var.which() == shared_str_t) {
+      shared_string_ptr& s = boost::get<shared_string_ptr>(var);
+      Lua *lua = lua_vm(L);
+      if(lua != nullptr)
+        lua->push_shared_string(L,s);
+      else
+        lua_pushlstring(L,s->str().data(),s->str().size());
     } else if(var.which() == ptr_t) {
-      auto ptr = boost::get<ptr_type >(var);
+      ptr_type& ptr = boost::get<ptr_type >(var);
       for(auto i=ptr->begin();i != ptr->end();++i)
-        i->unpack(L);
+        i->unpack(L,memo);
     } else if(var.which() == fut_t) {
       // Shouldn't ever happen
       //std::cout << "ERROR: Unrealized future in arg list" << std::endl;
@@ -213,9 +508,13 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
       future_type *fc = (future_type *)lua_touserdata(L,-1);
       *fc = boost::get<future_type>(var);
     } else if(var.which() == vector_t) {
+      vector_ptr& v = boost::get<vector_ptr>(var);
+      if(push_cached_userdata(L,v.get()))
+        return;
       new_vector(L);
       vector_ptr *tp = (vector_ptr *)lua_touserdata(L,-1);
-      *tp = boost::get<vector_ptr>(var);
+      *tp = v;
+      cache_userdata(L,-1,v.get());
     } else if(var.which() == locality_t) {
       new_locality(L);
       hpx::naming::id_type *tp = (hpx::naming::id_type *)lua_touserdata(L,-1);
@@ -225,9 +524,17 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
       lua_aux_client *tp = (lua_aux_client*)lua_touserdata(L,-1);
       *tp = boost::get<lua_aux_client>(var);
     } else if(var.which() == table_t) {
+      // Reading the same table again, as in c[i][j], gives the same
+      // userdata instead of a new one
+      table_ptr& t = boost::get<table_ptr>(var);
+      if(push_cached_userdata(L,t.get()) || (memo != nullptr && memo->push(L,t.get())))
+        return;
       new_table(L);
       table_ptr *tp = (table_ptr *)lua_touserdata(L,-1);
-      *tp = boost::get<table_ptr>(var);
+      *tp = t;
+      cache_userdata(L,-1,t.get());
+      if(memo != nullptr)
+        memo->remember(L,t.get());
       /*
       try {
         table_ptr& table = boost::get<table_ptr>(var);
@@ -242,7 +549,7 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
               abort();
             }
           } else if(which == 1) { // string
-            std::string str = boost::get<std::string>(i->first);
+            std::string str = boost::get<atom>(i->first).str();
             lua_pushstring(L,str.c_str());
           } else {
             std::cout << "ERROR: Unknown key type: " << which << std::endl;
@@ -257,25 +564,51 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
       */
     } else if(var.which() == bytecode_t) {
       Bytecode& bc = boost::get<Bytecode>(var);
-      lua_load(L,(lua_Reader)lua_read,(void *)&bc.data,0,"b");
+      if(load_cached(L,bc.data) != LUA_OK)
+        SHOW_ERROR(L);
     } else if(var.which() == closure_t) {
-      closure_ptr cp = boost::get<closure_ptr>(var);
-      lua_load(L,(lua_Reader)lua_read,(void *)&cp->code.data,0,"b");
-      int findex = lua_gettop(L);
-      if(cp->vars.size() > 0) {
-        // Passing a closure
-        const int sz = cp->vars.size();
-        for(int n=0; n < sz;++n) {
-          ClosureVar& cv = cp->vars[n];
-          if(cv.name == "_ENV") {
-            lua_getglobal(L,"_G");
-          } else {
-            cv.val.unpack(L);
-          }
-          lua_setupvalue(L,findex,n+1);
-          cp->vars.push_back(cv);
-        }
-        lua_pop(L,lua_gettop(L)-findex);
+      closure_ptr& cp = boost::get<closure_ptr>(var);
+      // A cached closure may be the one currently running in this
+      // VM, so only share it when there is nothing but _ENV to bind.
+      int rc;
+      if(has_upvalues(cp->vars))
+        rc = lua_load(L,(lua_Reader)lua_read,(void *)&cp->code.data,0,"b");
+      else
+        rc = load_cached(L,cp->code.data,cp->code_hash);
+      if(rc != LUA_OK) {
+        SHOW_ERROR(L);
+        lua_pushnil(L);
+      } else {
+        bind_upvalues(L,lua_gettop(L),cp->vars,memo);
+      }
+    } else if(var.which() == dense_t) {
+      dense_ptr& d = boost::get<dense_ptr>(var);
+      if(memo != nullptr && memo->push(L,d.get()))
+        return;
+      const int n = d->size();
+      lua_createtable(L,n,0);
+      for(int i=0;i<n;i++) {
+        lua_pushnumber(L,(*d)[i]);
+        lua_rawseti(L,-2,i+1);
+      }
+      if(memo != nullptr)
+        memo->remember(L,d.get());
+    } else if(var.which() == stream_t) {
+      const stream_data *st = boost::get<stream_ptr>(var).get();
+      if(memo != nullptr && memo->push(L,st))
+        return;
+      const char *p = st->bytes.data();
+      const int top = lua_gettop(L);
+      lua_newtable(L); // tables decoded so far, for stream_ref
+      int ntables = 0;
+      if(!unstream_value(L,p,p+st->bytes.size(),top+1,ntables)) {
+        std::cout << "ERROR: Corrupt table stream" << std::endl;
+        lua_settop(L,top);
+        lua_pushnil(L);
+      } else {
+        lua_remove(L,top+1);
+        if(memo != nullptr)
+          memo->remember(L,st);
       }
     } else if(var.which() == empty_t) {
       lua_pushnil(L);
@@ -285,50 +618,176 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
     }
   }
 
-  void Holder::pack(lua_State *L,int index) {
+//--- Table key for the number at index. Lua integers take the fast
+//--- path and never go through a double.
+key_type lua_number_key(lua_State *L,int index) {
+#if LUA_VERSION_NUM >= 503
+  if(lua_isinteger(L,index))
+    return key_type(std::int64_t(lua_tointeger(L,index)));
+#endif
+  return number_key(lua_tonumber(L,index));
+}
+
+  //--- Encode entries 1..n of d the way stream_value() would
+  void stream_dense(lua_State *L,const dense_data& d,std::size_t n,
+      std::string& out,std::map<const void *,std::uint64_t>& seen) {
+    for(std::size_t i=1;i <= n;i++) {
+      lua_pushinteger(L,i);
+      lua_pushnumber(L,d[i-1]);
+      stream_value(L,-2,out,1,seen);
+      stream_value(L,-1,out,1,seen);
+      lua_pop(L,2);
+    }
+  }
+
+  //--- Encode the table at index directly into bytes, or if it is a
+  //--- sequence 1..n of numbers with no other keys, as a dense array.
+  //--- Both are decided in one walk of the table. Fails, and the
+  //--- table goes through the Holder tree instead, if it contains
+  //--- userdata, functions or other values that need a Holder.
+  bool Holder::pack_stream(lua_State *L,int index) {
+    index = lua_absindex(L,index);
+    if(!lua_checkstack(L,4))
+      return false;
+    const std::size_t n = lua_rawlen(L,index);
+    // Set while the table may still be dense
+    dense_ptr d;
+    if(n > 0) {
+      d.reset(new dense_data());
+      d->resize(n);
+    }
+    std::size_t entries = 0;
+    // Entries 1..held arrived first and in order, and are only in d
+    // until the table turns out not to be dense
+    std::size_t held = 0;
+    bool holding = true;
+    stream_ptr st(new stream_data());
+    std::map<const void *,std::uint64_t> seen;
+    seen[lua_topointer(L,index)] = 0;
+    st->bytes.push_back(stream_table);
+    stream_varint(st->bytes,n);
+    const int top = lua_gettop(L);
+    lua_pushnil(L);
+    while(lua_next(L,index) != 0) {
+      bool fits = false;
+      if(d) {
+        bool number = lua_type(L,-1) == LUA_TNUMBER;
+#if LUA_VERSION_NUM >= 503
+        // Integers would come back as floats
+        number = number && !lua_isinteger(L,-1);
+#endif
+        double key = lua_type(L,-2) == LUA_TNUMBER ? lua_tonumber(L,-2) : 0;
+        // Range and integrality first: converting a negative or huge
+        // double to std::size_t is undefined.
+        if(number && key >= 1 && key <= double(n) && key == std::floor(key)) {
+          std::size_t i = std::size_t(key);
+          fits = true;
+          (*d)[i-1] = lua_tonumber(L,-1);
+          entries++;
+          if(holding && i == held+1) {
+            held++;
+            lua_pop(L,1);
+            continue;
+          }
+        }
+      }
+      if(holding) {
+        if(held > 0)
+          stream_dense(L,*d,held,st->bytes,seen);
+        holding = false;
+      }
+      if(!fits)
+        d.reset();
+      if(!stream_value(L,-2,st->bytes,1,seen) ||
+          !stream_value(L,-1,st->bytes,1,seen)) {
+        lua_settop(L,top);
+        return false;
+      }
+      lua_pop(L,1);
+    }
+    if(d && entries == n) {
+      var = d;
+      return true;
+    }
+    if(holding && held > 0)
+      stream_dense(L,*d,held,st->bytes,seen);
+    st->bytes.push_back(stream_end);
+    var = st;
+    return true;
+  }
+
+  void Holder::pack(lua_State *L,int index,pack_memo *memo) {
+    index = lua_absindex(L,index);
+    pack_memo local_memo;
+    if(memo == nullptr)
+      memo = &local_memo;
+#if LUA_VERSION_NUM >= 503
+    if(lua_isinteger(L,index)) {
+      set(std::int64_t(lua_tointeger(L,index)));
+    } else
+#endif
     if(lua_isnumber(L,index)) {
       set(lua_tonumber(L,index));
     } else if(lua_isstring(L,index)) {
-      set(lua_tostring(L,index));
+      size_t len;
+      const char *str = lua_tolstring(L,index,&len);
+      Lua *lua;
+      if(len >= shared_string_min && (lua = lua_vm(L)) != nullptr)
+        var = lua->share_string(L,index);
+      else
+        set(std::string(str,len));
     } else if(lua_isuserdata(L,index)) {
-      lua_pushvalue(L,index);
-      int n1 = lua_gettop(L);
-      get_mtable(L);
-      int n2 = lua_gettop(L);
-      assert(n2 == n1 + 1);
-      std::string s = lua_tostring(L,-1);
-      lua_pop(L,2);
+      const char *s = xlua_type(L,index);
       if(s == future_metatable_name) {
         var = *(future_type *)lua_touserdata(L,index);
       } else if(s == table_metatable_name) {
-        var = *(table_ptr *)lua_touserdata(L,index);
+        table_ptr& t = *(table_ptr *)lua_touserdata(L,index);
+        cache_userdata(L,index,t.get());
+        var = t;
       } else if(s == vector_metatable_name) {
-        var = *(vector_ptr *)lua_touserdata(L,index);
+        vector_ptr& v = *(vector_ptr *)lua_touserdata(L,index);
+        cache_userdata(L,index,v.get());
+        var = v;
       } else if(s == locality_metatable_name) {
         var = *(hpx::naming::id_type *)lua_touserdata(L,index);
       } else if(s == lua_client_metatable_name) {
         var = *(lua_aux_client *)lua_touserdata(L,index);
       } else {
-        std::cerr << "Can't pack key value!" << lua_type(L,-1) << " s=" << s << std::endl;
+        std::cerr << "Can't pack key value!" << lua_type(L,-1) << " s=" << (s == nullptr ? "?" : s) << std::endl;
         abort();
       }
+    } else if(lua_istable(L,index) && memo->seen.count(lua_topointer(L,index)) > 0) {
+      // seen earlier in this pack: share it rather than copy it again
+      if(memo->open.count(lua_topointer(L,index)) > 0)
+        throw pack_error("can't pack a table that contains itself");
+      var = memo->seen[lua_topointer(L,index)];
+    } else if(lua_istable(L,index) && memo->flatten && pack_stream(L,index)) {
+      // packed as a dense array of numbers or as plain data,
+      // straight into bytes
+      memo->seen[lua_topointer(L,index)] = var;
     } else if(lua_istable(L,index)) {
+      int nn = lua_gettop(L);
+      // A table_t holds table_t values, which can be written through,
+      // so the tables below this one are not flattened either.
+      bool flatten = memo->flatten;
       try {
-        int nn = lua_gettop(L);
         lua_pushvalue(L,index);
         lua_pushnil(L);
         var = table_ptr(new table_inner());
+        // Remembered before the contents, so a cycle back to this
+        // table is caught instead of recursing.
+        memo->seen[lua_topointer(L,index)] = var;
+        memo->open.insert(lua_topointer(L,index));
+        memo->flatten = false;
         table_ptr& table = boost::get<table_ptr>(var);
         while(lua_next(L,-2) != 0) {
           lua_pushvalue(L,-2);
           if(lua_isnumber(L,-1)) {
             double key = lua_tonumber(L,-1);
-            if(key==table->size+1)
-              table->size = key;
             Holder h;
-            h.pack(L,-2);
+            h.pack(L,-2,memo);
             if(h.var.which() != empty_t) {
-              (table->t)[key] = h;
+              (table->t)[lua_number_key(L,-1)] = std::move(h);
               if(key == 0) {
                 std::cout << "pack0:PRINT=" << (*this) << std::endl;
                 abort();
@@ -338,57 +797,61 @@ bool cmp_meta(lua_State *L,int index,const char *meta_name);
               abort();
             }
           } else if(lua_isstring(L,-1)) {
-            const char *keys = lua_tostring(L,-1);
-            if(keys == nullptr)
-              continue;
-            std::string key{keys};
             Holder h;
-            h.pack(L,-2);
+            h.pack(L,-2,memo);
             if(h.var.which() != empty_t) {
-              (table->t)[key] = h;
+              (table->t)[lua_atom(L,-1)] = std::move(h);
             } else {
               std::cout << "pack1:PRINT=" << (*this) << std::endl;
               abort();
             }
+          } else if(lua_isboolean(L,-1)) {
+            Holder h;
+            h.pack(L,-2,memo);
+            (table->t)[lua_bool(lua_toboolean(L,-1) != 0)] = std::move(h);
           } else {
             std::cerr << "Can't pack key value!" << lua_type(L,-1) << std::endl;
             abort();
           }
           lua_pop(L,2);
         }
+        memo->open.erase(lua_topointer(L,index));
+        memo->flatten = flatten;
         if(lua_gettop(L) > nn)
           lua_pop(L,lua_gettop(L)-nn);
         //std::cout << "pack:PRINT=" << (*this) << std::endl;
+      } catch(pack_error&) {
+        memo->open.erase(lua_topointer(L,index));
+        memo->flatten = flatten;
+        lua_settop(L,nn);
+        throw;
       } catch(std::exception e) {
         std::cout << "EX=" << e.what() << std::endl;
       }
     } else if(lua_isfunction(L,index)) {
-      lua_pushvalue(L,index);
-      assert(lua_isfunction(L,-1));
-      closure_ptr cp{new Closure()};
-      lua_dump(L,(lua_Writer)lua_write,&cp->code.data);
+      closure_ptr cp{make_pooled<Closure>()};
+      dump_function(L,index,cp->code.data,&cp->code_hash);
       for(int i=1;true;i++) {
         const char *name = lua_getupvalue(L,index,i);
         if(name == 0) break;
         ClosureVar cv;
         cv.name = name;
         if(env != name) {
-          cv.val.pack(L,-1);
+          cv.val.pack(L,-1,memo);
         } else {
           cv.val.var = Empty();
         }
-        cp->vars.push_back(cv);
+        lua_pop(L,1);
+        cp->vars.push_back(std::move(cv));
       }
       var = cp;
-      lua_pop(L,1);
     } else if(lua_isnil(L,index)) {
       Empty e;
       var = e;
     } else if(lua_isuserdata(L,index)) {
       std::cout << "Can't pack unknown user data!" << std::endl;
     } else if(lua_isboolean(L,index)) {
-      // TODO: Make real support for booleans
-      var = lua_toboolean(L,index);
+      set(lua_toboolean(L,index) != 0);
     } else {
       int t = lua_type(L,index);
       std::cerr << "Can't pack value! " << t << std::endl;
@@ -419,58 +882,59 @@ const char *metatables[] = {
   locality_metatable_name,vector_metatable_name,
   0};
 
+//--- Key, in the metatable of each xlua userdata type, of a light
+//--- userdata pointing at the type's metatable name. Types are told
+//--- apart by comparing those pointers, without calling into Lua.
+static char type_tag_key;
+
+//--- Tag the metatable on top of the stack as the one for name
+void tag_metatable(lua_State *L,const char *name) {
+  lua_pushlightuserdata(L,(void *)name);
+  lua_rawsetp(L,-2,&type_tag_key);
+}
+
+//--- The metatable name of the xlua userdata at index, as the
+//--- xxx_metatable_name pointer itself, or nullptr for other values
+const char *xlua_type(lua_State *L,int index) {
+  if(lua_type(L,index) != LUA_TUSERDATA || !lua_getmetatable(L,index))
+    return nullptr;
+  lua_rawgetp(L,-1,&type_tag_key);
+  const char *name = (const char *)lua_touserdata(L,-1);
+  lua_pop(L,2);
+  return name;
+}
+
+//--- Lua: get_mtable(v) returns the type name of an xlua userdata
 int get_mtable(lua_State *L) {
-  if(lua_isnil(L,-1))
-    return false;
-  if(!lua_isuserdata(L,-1))
-    return false;
-  int ss1 = lua_gettop(L);
-  lua_getfield(L,-1,"Name");
-  int ss2 = lua_gettop(L);
-  if(ss1+1 != ss2)
-    return false;
-  if(!lua_iscfunction(L,-1))
-    return false;
-  lua_CFunction f = lua_tocfunction(L,-1);
-  lua_pop(L,1);
-  if(f == nullptr)
-    return false;
-  (*f)(L);
-  return lua_gettop(L);
+  const char *name = xlua_type(L,-1);
+  if(name == nullptr)
+    lua_pushnil(L);
+  else
+    lua_pushstring(L,name);
+  return 1;
 }
 
 bool cmp_meta(lua_State *L,int index,const char *name) {
-  if(lua_isnil(L,index))
-    return false;
-  if(!lua_isuserdata(L,index))
-    return false;
-  int ss1 = lua_gettop(L);
-  lua_getfield(L,index,"Name");
-  int ss2 = lua_gettop(L);
-  if(ss1+1 != ss2)
-    return false;
-  if(!lua_iscfunction(L,-1))
-    return false;
-  lua_CFunction f = lua_tocfunction(L,-1);
-  lua_pop(L,1);
-  if(f == nullptr)
-    return false;
-  (*f)(L);
-  if(lua_isstring(L,-1)) {
-    std::string nm = lua_tostring(L,-1);
-    lua_pop(L,1);
-    return nm == name;
-  }
-  return false;
+  return xlua_type(L,index) == name;
 }
 
 guard_type global_guarded{new Guard()};
 
 std::ostream& operator<<(std::ostream& out,const key_type& kt) {
-  if(kt.which() == 0)
-    out << boost::get<double>(kt) << "{f}";
-  else
-    out << boost::get<std::string>(kt) << "{s}";
+  switch(kt.which()) {
+    case num_key:
+      out << boost::get<double>(kt) << "{f}";
+      break;
+    case str_key:
+      out << boost::get<atom>(kt) << "{s}";
+      break;
+    case int_key:
+      out << boost::get<std::int64_t>(kt) << "{i}";
+      break;
+    case bool_key:
+      out << (boost::get<lua_bool>(kt).value ? "true" : "false") << "{b}";
+      break;
+  }
   return out;
 }
 std::ostream& operator<<(std::ostream& out,const Holder& holder) {
@@ -480,9 +944,21 @@ std::ostream& operator<<(std::ostream& out,const Holder& holder) {
     case Holder::num_t:
       out << boost::get<double>(holder.var) << "{f}";
       break;
+    case Holder::int_t:
+      out << boost::get<std::int64_t>(holder.var) << "{i}";
+      break;
+    case Holder::bool_t:
+      out << (boost::get<lua_bool>(holder.var).value ? "true" : "false");
+      break;
     case Holder::str_t:
       out << boost::get<std::string>(holder.var) << "{s}";
       break;
+    case Holder::shared_str_t:
+      out << boost::get<shared_string_ptr>(holder.var)->str() << "{s}";
+      break;
+    case Holder::frozen_t:
+      out << "frozen:" << boost::get<frozen_ref>(holder.var).hash;
+      break;
     case Holder::table_t:
       {
         table_ptr t = boost::get<table_ptr>(holder.var);
@@ -506,6 +982,21 @@ std::ostream& operator<<(std::ostream& out,const Holder& holder) {
         out << "]";
       }
       break;
+    case Holder::dense_t:
+      {
+        dense_ptr t = boost::get<dense_ptr>(holder.var);
+        out << "{";
+        for(int i=0;i < t->size(); ++i) {
+          if(i > 0)
+            out << ",";
+          out << (*t)[i];
+        }
+        out << "}";
+      }
+      break;
+    case Holder::stream_t:
+      out << "Stream(" << boost::get<stream_ptr>(holder.var)->bytes.size() << ")";
+      break;
     case Holder::fut_t:
       out << "Fut()";
       break;
@@ -529,17 +1020,426 @@ std::ostream& operator<<(std::ostream& out,const Holder& holder) {
 
 //--- Transfer lua bytecode to/from a std:string
 int lua_write(lua_State *L,const char *str,unsigned long len,std::string *buf) {
-    std::string b(str,len);
-    *buf += b;
+    buf->append(str,len);
     return 0;
 }
 
+//--- lua_dump the function at index into code, and if hash is given
+//--- store the bytecode_hash() of it there. Dumps and their hashes are
+//--- cached in a table with weak keys, so spawning the same function
+//--- repeatedly serializes and hashes it once and the entry is
+//--- dropped with the function.
+void dump_function(lua_State *L,int index,std::string& code,std::uint64_t *hash) {
+    index = lua_absindex(L,index);
+    code.clear();
+    if(!lua_isfunction(L,index))
+      return;
+    lua_rawgetp(L,LUA_REGISTRYINDEX,&dump_cache_key);
+    lua_pushvalue(L,index);
+    lua_rawget(L,-2);
+    if(lua_istable(L,-1)) {
+      size_t len;
+      lua_rawgeti(L,-1,1);
+      const char *str = lua_tolstring(L,-1,&len);
+      code.assign(str,len);
+      if(hash != nullptr) {
+        lua_rawgeti(L,-2,2);
+        std::memcpy(hash,lua_tostring(L,-1),sizeof(*hash));
+        lua_pop(L,1);
+      }
+      lua_pop(L,3);
+      return;
+    }
+    lua_pop(L,1);
+    lua_pushvalue(L,index);
+    lua_dump(L,(lua_Writer)lua_write,&code);
+    lua_pop(L,1);
+    std::uint64_t h = bytecode_hash(code);
+    if(hash != nullptr)
+      *hash = h;
+    lua_pushvalue(L,index);
+    lua_createtable(L,2,0);
+    lua_pushlstring(L,code.data(),code.size());
+    lua_rawseti(L,-2,1);
+    lua_pushlstring(L,(const char *)&h,sizeof(h));
+    lua_rawseti(L,-2,2);
+    lua_rawset(L,-3);
+    lua_pop(L,1);
+}
+
 const char *lua_read(lua_State *L,void *data,size_t *size) {
     std::string *rbuf = (std::string*)data;
     (*size) = rbuf->size();
     return rbuf->c_str();
 }
 
+//--- 64-bit FNV-1a hash
+std::uint64_t content_hash(const char *data,std::size_t n) {
+  std::uint64_t h = 14695981039346656037ULL;
+  for(std::size_t i=0;i < n;i++) {
+    h ^= (unsigned char)data[i];
+    h *= 1099511628211ULL;
+  }
+  return h;
+}
+
+//--- Identifies function bytecode
+std::uint64_t bytecode_hash(const std::string& code) {
+  return content_hash(code.data(),code.size());
+}
+
+//--- Load bytecode as a function. The result is cached in the VM by
+//--- the hash of the bytecode, so each distinct function is parsed
+//--- once per VM; later loads return the same closure. Since that
+//--- closure is shared, it is only used for functions with nothing
+//--- but _ENV to bind; callers load the others afresh with lua_load
+//--- so their upvalues are their own. Each entry holds the bytecode
+//--- as well, and a hit is only taken when it matches, so two
+//--- functions with the same hash are never confused. The table is
+//--- started afresh once it holds proto_cache_cap functions.
+int load_cached(lua_State *L,const std::string& code,std::uint64_t h) {
+  if(h == 0)
+    h = bytecode_hash(code);
+  lua_rawgetp(L,LUA_REGISTRYINDEX,&proto_cache_key);
+  lua_pushlstring(L,(const char *)&h,sizeof(h));
+  lua_rawget(L,-2);
+  if(lua_istable(L,-1)) {
+    size_t len;
+    lua_rawgeti(L,-1,1);
+    const char *stored = lua_tolstring(L,-1,&len);
+    const bool same = stored != nullptr && len == code.size()
+      && std::memcmp(stored,code.data(),len) == 0;
+    lua_pop(L,1);
+    if(same) {
+      lua_rawgeti(L,-1,2);
+      lua_replace(L,-3);
+      lua_pop(L,1);
+      return LUA_OK;
+    }
+  }
+  lua_pop(L,1);
+  int rc = lua_load(L,(lua_Reader)lua_read,(void *)&code,0,"b");
+  if(rc == LUA_OK) {
+    Lua *lua = lua_vm(L);
+    if(lua != nullptr && ++lua->proto_cache_size > proto_cache_cap) {
+      lua_newtable(L);
+      lua_pushvalue(L,-1);
+      lua_rawsetp(L,LUA_REGISTRYINDEX,&proto_cache_key);
+      lua_replace(L,-3);
+      lua->proto_cache_size = 1;
+    }
+    lua_pushlstring(L,(const char *)&h,sizeof(h));
+    lua_createtable(L,2,0);
+    lua_pushlstring(L,code.data(),code.size());
+    lua_rawseti(L,-2,1);
+    lua_pushvalue(L,-3);
+    lua_rawseti(L,-2,2);
+    lua_rawset(L,-4);
+  }
+  lua_remove(L,-2);
+  return rc;
+}
+
+void Closure::reset_pooled() {
+  vars.clear();
+  code.data.clear();
+  fid = -1;
+  code_hash = 0;
+  hash = 0;
+  origin = 0;
+}
+
+//--- Bytecode known to this locality by the locality it came from
+//--- and its hash, and the (locality,hash) pairs whose bytecode has
+//--- already been sent to that locality. Keying by origin as well
+//--- means bytecode from two senders never meets under one hash, and
+//--- a sender never sends two functions with the same hash by hash
+//--- (see compact_closure()). Once bytecode_store holds
+//--- bytecode_store_cap functions it becomes bytecode_store_old, the
+//--- oldest functions are dropped and bytecode_sent is cleared, so
+//--- later calls carry their bytecode again. A hash sent before that
+//--- can still be served from bytecode_store_old.
+typedef std::pair<std::uint32_t,std::uint64_t> bytecode_key;
+std::map<bytecode_key,std::string> bytecode_store, bytecode_store_old;
+std::set<std::pair<std::uint32_t,std::uint64_t> > bytecode_sent;
+hpx::lcos::local::spinlock bytecode_mtx;
+
+//--- The bytecode for key, or nullptr. Call with bytecode_mtx held.
+const std::string *find_bytecode(const bytecode_key& key) {
+  auto search = bytecode_store.find(key);
+  if(search != bytecode_store.end())
+    return &search->second;
+  search = bytecode_store_old.find(key);
+  if(search != bytecode_store_old.end())
+    return &search->second;
+  return nullptr;
+}
+
+//--- False, and nothing is stored, if other bytecode is already
+//--- stored for key. Call with bytecode_mtx held.
+bool store_bytecode(const bytecode_key& key,const std::string& code) {
+  const std::string *stored = find_bytecode(key);
+  if(stored != nullptr && *stored != code)
+    return false;
+  if(bytecode_store.find(key) != bytecode_store.end())
+    return true;
+  if(bytecode_store.size() >= bytecode_store_cap) {
+    bytecode_store_old.swap(bytecode_store);
+    bytecode_store.clear();
+    bytecode_sent.clear();
+  }
+  bytecode_store[key] = code;
+  return true;
+}
+
+//--- Bytecode that arrived in full. A sender only reuses a hash for
+//--- other bytecode once it has dropped the first, so the new
+//--- bytecode replaces the old.
+void remember_bytecode(const bytecode_key& key,const std::string& code) {
+  std::lock_guard<hpx::lcos::local::spinlock> lk(bytecode_mtx);
+  if(!store_bytecode(key,code)) {
+    bytecode_store.erase(key);
+    bytecode_store_old.erase(key);
+    store_bytecode(key,code);
+  }
+}
+
+//--- Prepare a closure for a call on locality dest. The first call
+//--- of a function to a locality carries the bytecode; later ones
+//--- carry only the hash, and the receiver uses its own copy. A
+//--- function whose hash is taken by another one here is always sent
+//--- in full, without a hash.
+void compact_closure(Closure& cl,const hpx::naming::id_type& dest) {
+  if(!is_bytecode(cl.code.data))
+    return;
+  const std::uint32_t here = hpx::get_locality_id();
+  const std::uint32_t there = hpx::naming::get_locality_id_from_id(dest);
+  if(there == here)
+    return;
+  cl.hash = cl.code_hash != 0 ? cl.code_hash : bytecode_hash(cl.code.data);
+  cl.origin = here;
+  std::lock_guard<hpx::lcos::local::spinlock> lk(bytecode_mtx);
+  if(!store_bytecode(bytecode_key(here,cl.hash),cl.code.data)) {
+    cl.hash = 0;
+    return;
+  }
+  if(!bytecode_sent.insert(std::make_pair(there,cl.hash)).second)
+    cl.code.data.clear();
+}
+
+//--- Bytecode for a hash, served to localities that missed it
+std::string fetch_bytecode(std::uint64_t h) {
+  std::lock_guard<hpx::lcos::local::spinlock> lk(bytecode_mtx);
+  const std::string *code = find_bytecode(bytecode_key(hpx::get_locality_id(),h));
+  if(code == nullptr)
+    return std::string();
+  return *code;
+}
+
+//--- Frozen values this locality has sent by hash, kept to serve
+//--- fetch_frozen() for as long as the values themselves live. The
+//--- call that sends a hash keeps its value alive until it is done
+//--- (see keep_frozen()). Expired entries are swept whenever the map
+//--- has doubled in size since the last sweep.
+struct frozen_entry {
+  boost::weak_ptr<table_inner> table;
+  boost::weak_ptr<vector_data> vector;
+};
+std::map<std::uint64_t,frozen_entry> frozen_store;
+std::size_t frozen_store_sweep = 64;
+//--- Frozen values that arrived by hash, by the locality that sent
+//--- them and the hash, most recently used first, at most
+//--- frozen_cache_cap() of them. Values still being fetched are in
+//--- here too, so each is only requested once.
+typedef std::pair<std::uint32_t,std::uint64_t> frozen_key;
+typedef std::list<std::pair<frozen_key,hpx::shared_future<Holder> > > frozen_lru_type;
+frozen_lru_type frozen_lru;
+std::map<frozen_key,frozen_lru_type::iterator> frozen_index;
+hpx::lcos::local::spinlock frozen_mtx;
+
+//--- Value of frozen for a frozen value that has no hash yet
+const std::uint64_t frozen_unhashed = 1;
+
+std::size_t frozen_cache_cap() {
+  static std::size_t cap = std::atoi(hpx::get_config_entry("xlua.frozen_cache","64").c_str());
+  return cap;
+}
+
+//--- The frozen field of a table_t or vector_t, else nullptr
+std::atomic<std::uint64_t> *frozen_field(Holder& h) {
+  if(h.var.which() == Holder::table_t)
+    return &boost::get<table_ptr>(h.var)->frozen;
+  if(h.var.which() == Holder::vector_t)
+    return &boost::get<vector_ptr>(h.var)->frozen;
+  return nullptr;
+}
+
+//--- Make a table_t or vector_t, and the tables and vectors it holds,
+//--- immutable. Their hashes are computed when first sent by hash.
+void freeze_value(Holder& h) {
+  std::atomic<std::uint64_t> *frozen = frozen_field(h);
+  std::uint64_t mutable_value = 0;
+  if(frozen == nullptr || !frozen->compare_exchange_strong(mutable_value,frozen_unhashed))
+    return;
+  if(h.var.which() == Holder::table_t) {
+    table_ptr& tp = boost::get<table_ptr>(h.var);
+    for(auto i=tp->t.begin();i != tp->t.end();++i)
+      freeze_value(i->second);
+  }
+}
+
+//--- The serialized contents of a value
+std::vector<char> frozen_bytes(Holder& h) {
+  std::vector<char> buf;
+  {
+    hpx::serialization::output_archive oa(buf);
+    oa << h;
+  }
+  return buf;
+}
+
+//--- Hash of the serialized contents of a frozen value
+std::uint64_t frozen_hash(Holder& h) {
+  std::atomic<std::uint64_t> *frozen = frozen_field(h);
+  std::uint64_t current = frozen->load();
+  if(current != frozen_unhashed)
+    return current;
+  std::vector<char> buf = frozen_bytes(h);
+  std::uint64_t hash = content_hash(buf.data(),buf.size());
+  // 0 and 1 mean mutable and unhashed
+  if(hash <= frozen_unhashed)
+    hash += 2;
+  // Another sender may have stored the same hash meanwhile
+  frozen->compare_exchange_strong(current,hash);
+  return hash;
+}
+
+//--- The value stored for hash, or an empty Holder if it has none
+//--- or the value is gone. Call with frozen_mtx held.
+Holder find_frozen(std::uint64_t hash) {
+  Holder h;
+  auto search = frozen_store.find(hash);
+  if(search == frozen_store.end())
+    return h;
+  if(table_ptr t = search->second.table.lock())
+    h.var = t;
+  else if(vector_ptr v = search->second.vector.lock())
+    h.var = v;
+  else
+    frozen_store.erase(search);
+  return h;
+}
+
+//--- Call with frozen_mtx held
+void store_frozen(std::uint64_t hash,Holder& h) {
+  frozen_entry& e = frozen_store[hash];
+  if(h.var.which() == Holder::table_t)
+    e.table = boost::get<table_ptr>(h.var);
+  else
+    e.vector = boost::get<vector_ptr>(h.var);
+  if(frozen_store.size() >= frozen_store_sweep) {
+    for(auto i=frozen_store.begin();i != frozen_store.end();) {
+      if(i->second.table.expired() && i->second.vector.expired())
+        i = frozen_store.erase(i);
+      else
+        ++i;
+    }
+    frozen_store_sweep = std::max<std::size_t>(64,2*frozen_store.size());
+  }
+}
+
+//--- True if a and b are the same table_t or vector_t
+bool same_frozen(Holder& a,Holder& b) {
+  std::atomic<std::uint64_t> *fa = frozen_field(a);
+  return fa != nullptr && fa == frozen_field(b);
+}
+
+//--- Send a frozen value by hash. A value whose hash is already taken
+//--- by a live value with other contents stays as it is and is sent
+//--- in full, so a receiver never gets the wrong value for a hash.
+void compact_frozen(Holder& h,std::uint32_t here,holder_list& keep) {
+  std::atomic<std::uint64_t> *frozen = frozen_field(h);
+  if(frozen == nullptr || frozen->load() == 0)
+    return;
+  frozen_ref ref;
+  ref.hash = frozen_hash(h);
+  ref.origin = here;
+  Holder stored;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lk(frozen_mtx);
+    stored = find_frozen(ref.hash);
+    if(stored.var.which() == Holder::empty_t)
+      store_frozen(ref.hash,h);
+  }
+  if(stored.var.which() != Holder::empty_t && !same_frozen(stored,h) &&
+      frozen_bytes(stored) != frozen_bytes(h))
+    return;
+  keep.push_back(std::move(h));
+  h.var = ref;
+}
+
+//--- Replace frozen tables and vectors among the arguments of a call
+//--- on locality dest with their hashes. The values are moved to
+//--- keep, which the caller holds until the call is done.
+void compact_frozen(holder_list& args,const hpx::naming::id_type& dest,holder_list& keep) {
+  const std::uint32_t here = hpx::get_locality_id();
+  if(hpx::naming::get_locality_id_from_id(dest) == here)
+    return;
+  for(auto i=args.begin();i != args.end();++i)
+    compact_frozen(*i,here,keep);
+}
+
+void compact_frozen(Closure& cl,const hpx::naming::id_type& dest,holder_list& keep) {
+  const std::uint32_t here = hpx::get_locality_id();
+  if(hpx::naming::get_locality_id_from_id(dest) == here)
+    return;
+  for(auto i=cl.vars.begin();i != cl.vars.end();++i)
+    compact_frozen(i->val,here,keep);
+}
+
+//--- f, holding on to the frozen values in keep until it is ready,
+//--- so the callee can still fetch them
+future_type keep_frozen(future_type f,ptr_type keep) {
+  if(keep->empty())
+    return f;
+  return f.then([keep](future_type r) {
+    return r.get();
+  });
+}
+
+//--- Frozen value for a hash, served to localities that missed it
+Holder fetch_frozen(std::uint64_t h) {
+  std::lock_guard<hpx::lcos::local::spinlock> lk(frozen_mtx);
+  return find_frozen(h);
+}
+
+//--- True if a closure captures anything besides _ENV
+bool has_upvalues(const std::vector<ClosureVar>& vars) {
+  for(auto i=vars.begin();i != vars.end();++i) {
+    if(i->name != env)
+      return true;
+  }
+  return false;
+}
+
+//--- Set the upvalues of the function at findex from vars
+void bind_upvalues(lua_State *L,int findex,std::vector<ClosureVar>& vars,unpack_memo *memo) {
+  unpack_memo local_memo;
+  if(memo == nullptr)
+    memo = &local_memo;
+  const int sz = vars.size();
+  for(int n=0; n < sz;++n) {
+    ClosureVar& cv = vars[n];
+    if(cv.name == env) {
+      lua_getglobal(L,"_G");
+    } else {
+      cv.val.unpack(L,memo);
+    }
+    lua_setupvalue(L,findex,n+1);
+  }
+  lua_pop(L,lua_gettop(L)-findex);
+}
+
 //--- Debugging utility, print the Lua stack
 std::ostream& show_stack(std::ostream& o,lua_State *L,const char *fname,int line,bool recurse) {
     int n = lua_gettop(L);
@@ -573,13 +1473,9 @@ std::ostream& show_stack(std::ostream& o,lua_State *L,const char *fname,int line
             }
           }
           */
-          int n = lua_gettop(L);
-          lua_pushvalue(L,i);
-          get_mtable(L);
-          std::string s = lua_tostring(L,-1);
-          lua_pop(L,lua_gettop(L)-n);
+          const char *s = xlua_type(L,i);
           if(!found)
-            OUT(i,s.c_str());
+            OUT(i,(s == nullptr ? "userdata" : s));
         }
         else if(lua_istable(L,i)) {
           o << i << "] table" << std::endl;
@@ -619,53 +1515,482 @@ std::ostream& show_stack(std::ostream& o,lua_State *L,const char *fname,int line
     return o;
 }
 
-//--- Synchronization for the function registry process
-std::map<std::string,std::string> function_registry;
+//--- Synchronization for the function registry process. Each
+//--- registration advances registry_epoch. A reader records the
+//--- epoch it started in (see registry_reader), and a snapshot that
+//--- was replaced in epoch e waits in function_table_retired until
+//--- no thread is reading in an epoch up to e.
+std::atomic<const function_table *> function_table_current{new function_table()};
+std::atomic<std::size_t> function_table_generation{0};
+std::atomic<std::uint64_t> registry_epoch{1};
+std::vector<std::pair<std::uint64_t,const function_table *> > function_table_retired;
+hpx::lcos::local::spinlock function_table_mtx;
+
+std::uint64_t oldest_registry_reader();
+
+//--- Call with function_table_mtx held
+void free_function_tables() {
+  // Pairs with the fence in registry_reader(): a reader not seen
+  // here reads the snapshot only after it was replaced
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+  const std::uint64_t oldest = oldest_registry_reader();
+  auto keep = function_table_retired.begin();
+  for(auto i=function_table_retired.begin();i != function_table_retired.end();++i) {
+    if(i->first < oldest)
+      delete i->second;
+    else
+      *keep++ = *i;
+  }
+  function_table_retired.erase(keep,function_table_retired.end());
+}
+
+void register_functions(const std::map<std::string,std::string>& fns) {
+  std::lock_guard<hpx::lcos::local::spinlock> lk(function_table_mtx);
+  const function_table *old_ft = function_table_current.load();
+  function_table *ft = new function_table(*old_ft);
+  for(auto i=fns.begin();i != fns.end();++i) {
+    auto search = ft->ids.find(i->first);
+    if(search == ft->ids.end()) {
+      registered_function rf;
+      rf.name = i->first;
+      ft->ids[i->first] = ft->functions.size();
+      ft->functions.push_back(std::move(rf));
+      search = ft->ids.find(i->first);
+    }
+    registered_function& rf = ft->functions[search->second];
+    if(rf.code && *rf.code == i->second)
+      continue;
+    rf.code.reset(new std::string(i->second));
+    rf.generation = ++ft->generation;
+  }
+  if(ft->generation == old_ft->generation) {
+    delete ft;
+    return;
+  }
+  function_table_current.store(ft);
+  function_table_generation.store(ft->generation);
+  function_table_retired.push_back(std::make_pair(registry_epoch++,old_ft));
+  free_function_tables();
+}
+
+void register_function(const std::string& name,const std::string& code) {
+  std::map<std::string,std::string> fns;
+  fns[name] = code;
+  register_functions(fns);
+}
+
+int find_function_id(const std::string& name) {
+  registry_reader reader;
+  const function_table *ft = reader.get();
+  auto search = ft->ids.find(name);
+  if(search == ft->ids.end())
+    return -1;
+  return search->second;
+}
+
+boost::shared_ptr<const std::string> find_function(const std::string& name) {
+  registry_reader reader;
+  const function_table *ft = reader.get();
+  auto search = ft->ids.find(name);
+  if(search == ft->ids.end())
+    return boost::shared_ptr<const std::string>();
+  return ft->functions[search->second].code;
+}
+
+//--- __index for _G when functions are loaded lazily. Looks the
+//--- missing name up in the registry and caches it as a real global.
+int registry_index(lua_State *L) {
+  if(lua_type(L,2) != LUA_TSTRING)
+    return 0;
+  Lua *lua = (Lua *)lua_touserdata(L,lua_upvalueindex(1));
+  int id = find_function_id(lua_tostring(L,2));
+  if(id < 0 || !lua->push_function(id))
+    return 0;
+  lua_pushvalue(L,2);
+  lua_pushvalue(L,-2);
+  lua_rawset(L,1);
+  return 1;
+}
+
+bool Lua::push_function(int id) {
+  registry_reader reader;
+  const function_table *ft = reader.get();
+  if(id < 0 || id >= (int)ft->functions.size())
+    return false;
+  const registered_function& rf = ft->functions[id];
+  lua_rawgeti(L,LUA_REGISTRYINDEX,fn_cache_ref);
+  if(id < (int)fn_loaded.size() && fn_loaded[id] == rf.generation) {
+    lua_rawgeti(L,-1,id+1);
+    lua_remove(L,-2);
+    return true;
+  }
+  if(lua_load(L,(lua_Reader)lua_read,(void *)rf.code.get(),rf.name.c_str(),"b") != 0) {
+    std::cout << "function " << rf.name << " size=" << rf.code->size() << std::endl;
+    SHOW_ERROR(L);
+    lua_pop(L,1);
+    return false;
+  }
+  lua_pushvalue(L,-1);
+  lua_rawseti(L,-3,id+1);
+  lua_remove(L,-2);
+  if((int)fn_loaded.size() <= id)
+    fn_loaded.resize(id+1,0);
+  fn_loaded[id] = rf.generation;
+  return true;
+}
+
+const atom::entry *atom::intern(const char *s,std::size_t n) {
+  if(n == 0)
+    return nullptr;
+  struct shard {
+    hpx::lcos::local::spinlock mtx;
+    std::unordered_map<std::string,std::size_t> atoms;
+  };
+  // Never destroyed, so atoms stay valid during static destruction
+  static shard *shards = new shard[atom_shards];
+  std::string str(s,n);
+  const std::size_t h = std::hash<std::string>()(str);
+  shard& sh = shards[h % atom_shards];
+  std::lock_guard<hpx::lcos::local::spinlock> lk(sh.mtx);
+  auto search = sh.atoms.find(str);
+  if(search == sh.atoms.end())
+    search = sh.atoms.emplace(std::move(str),h).first;
+  return &*search;
+}
+
+const std::string& atom::str() const {
+  static const std::string empty;
+  return p == nullptr ? empty : p->first;
+}
+
+std::ostream& operator<<(std::ostream& o,const atom& a) {
+  return o << a.str();
+}
+
+//--- The atom for the Lua string at index. Each VM keeps a table
+//--- from Lua string to atom, which Lua looks up by the string's
+//--- own hash, so a key already seen costs no copy and no lock.
+//--- The table is started afresh once it holds atom_cache_cap keys.
+atom lua_atom(lua_State *L,int index) {
+  index = lua_absindex(L,index);
+  size_t len;
+  const char *str = lua_tolstring(L,index,&len);
+  if(str == nullptr)
+    return atom();
+  lua_rawgetp(L,LUA_REGISTRYINDEX,&atom_cache_key);
+  if(!lua_istable(L,-1)) {
+    lua_pop(L,1);
+    return atom(str,len);
+  }
+  lua_pushvalue(L,index);
+  lua_rawget(L,-2);
+  if(lua_islightuserdata(L,-1)) {
+    atom a = atom::from_id(lua_touserdata(L,-1));
+    lua_pop(L,2);
+    return a;
+  }
+  lua_pop(L,1);
+  Lua *lua = lua_vm(L);
+  if(lua != nullptr && ++lua->atom_cache_size > atom_cache_cap) {
+    lua_pop(L,1);
+    lua_newtable(L);
+    lua_pushvalue(L,-1);
+    lua_rawsetp(L,LUA_REGISTRYINDEX,&atom_cache_key);
+    lua->atom_cache_size = 1;
+  }
+  atom a(str,len);
+  lua_pushvalue(L,index);
+  lua_pushlightuserdata(L,(void *)a.id());
+  lua_rawset(L,-3);
+  lua_pop(L,1);
+  return a;
+}
+
+Lua *lua_vm(lua_State *L) {
+  lua_rawgetp(L,LUA_REGISTRYINDEX,&lua_vm_key);
+  Lua *lua = (Lua *)lua_touserdata(L,-1);
+  lua_pop(L,1);
+  return lua;
+}
+
+void Lua::clear_shared_strings() {
+  for(auto i=shared_strings.begin();i != shared_strings.end();++i)
+    luaL_unref(L,LUA_REGISTRYINDEX,i->second.ref);
+  shared_strings.clear();
+  shared_string_data.clear();
+  shared_string_bytes = 0;
+}
+
+void Lua::remember_shared_string(lua_State *L_,int index,const shared_string_ptr& s) {
+  if(shared_strings.size() >= shared_string_cache_cap ||
+      shared_string_bytes + s->str().size() > shared_string_cache_bytes)
+    clear_shared_strings();
+  // The reference keeps the Lua string, and so its bytes, alive
+  lua_pushvalue(L_,index);
+  shared_string_entry& e = shared_strings[s.get()];
+  e.str = s;
+  e.ref = luaL_ref(L_,LUA_REGISTRYINDEX);
+  shared_string_data[lua_tostring(L_,index)] = s;
+  shared_string_bytes += s->str().size();
+}
+
+void Lua::push_shared_string(lua_State *L_,const shared_string_ptr& s) {
+  auto search = shared_strings.find(s.get());
+  if(search != shared_strings.end()) {
+    lua_rawgeti(L_,LUA_REGISTRYINDEX,search->second.ref);
+    return;
+  }
+  lua_pushlstring(L_,s->str().data(),s->str().size());
+  remember_shared_string(L_,-1,s);
+}
+
+shared_string_ptr Lua::share_string(lua_State *L_,int index) {
+  index = lua_absindex(L_,index);
+  size_t len;
+  const char *str = lua_tolstring(L_,index,&len);
+  auto search = shared_string_data.find(str);
+  if(search != shared_string_data.end())
+    return search->second;
+  shared_string_ptr s(new shared_string(std::string(str,len)));
+  remember_shared_string(L_,index,s);
+  return s;
+}
+
+bool lua_lazy_functions() {
+  return hpx::get_config_entry("xlua.lazy_functions","1") != "0";
+}
+
+void Lua::sync_registry() {
+  if(synced_generation == function_table_generation.load())
+    return;
+  registry_reader reader;
+  const function_table *ft = reader.get();
+  lua_pushglobaltable(L);
+  for(int id=0;id < (int)ft->functions.size();id++) {
+    const registered_function& rf = ft->functions[id];
+    if(rf.generation <= synced_generation)
+      continue;
+    lua_pushstring(L,rf.name.c_str());
+    if(lazy_functions) {
+      // Drop the stale copy, registry_index() reloads it when used
+      lua_pushnil(L);
+    } else if(!push_function(id)) {
+      lua_pop(L,1);
+      continue;
+    }
+    lua_rawset(L,-3);
+  }
+  lua_pop(L,1);
+  synced_generation = ft->generation;
+}
 
 #include <hpx/util/thread_specific_ptr.hpp>
+
+//--- Every live holder, so the stats can be summed up, and the
+//--- counts of holders whose threads have exited. Defined before
+//--- lua_ptr so that they outlive it.
+std::vector<LuaHolder *> lua_holders;
+lua_pool_stats lua_retired_stats;
+hpx::lcos::local::spinlock lua_holders_mtx;
+
+LuaHolder::~LuaHolder() {
+  std::lock_guard<hpx::lcos::local::spinlock> lk(lua_holders_mtx);
+  auto search = std::find(lua_holders.begin(),lua_holders.end(),this);
+  if(search != lua_holders.end())
+    lua_holders.erase(search);
+  lua_retired_stats.hits += hits;
+  lua_retired_stats.overflow_hits += overflow_hits;
+  lua_retired_stats.misses += misses;
+  lua_retired_stats.allocs += allocs;
+  lua_retired_stats.frees += frees;
+}
+
 struct lua_interpreter_tag {};
 hpx::util::thread_specific_ptr<
     LuaHolder,
     lua_interpreter_tag
 > lua_ptr;
 
+//--- Shared overflow list for VMs released while the
+//--- releasing thread's own slots are full.
+std::vector<Lua *> lua_overflow;
+std::atomic<std::size_t> lua_overflow_size{0};
+hpx::lcos::local::spinlock lua_overflow_mtx;
+
+LuaHolder *get_lua_holder() {
+    LuaHolder *h = lua_ptr.get();
+    if(h == nullptr) {
+      lua_ptr.reset(h = new LuaHolder());
+      std::lock_guard<hpx::lcos::local::spinlock> lk(lua_holders_mtx);
+      lua_holders.push_back(h);
+    }
+    return h;
+}
+
+registry_reader::registry_reader() : holder(get_lua_holder()) {
+  if(holder->registry_depth++ > 0)
+    return;
+  holder->registry_epoch.store(registry_epoch.load());
+  // Published before the snapshot is read (see free_function_tables())
+  std::atomic_thread_fence(std::memory_order_seq_cst);
+}
+
+registry_reader::~registry_reader() {
+  if(--holder->registry_depth == 0)
+    holder->registry_epoch.store(0,std::memory_order_release);
+}
+
+const function_table *registry_reader::get() const {
+  return function_table_current.load(std::memory_order_acquire);
+}
+
+//--- The earliest epoch in which a thread is still reading the
+//--- function registry, or the largest value if none is
+std::uint64_t oldest_registry_reader() {
+  std::uint64_t oldest = std::numeric_limits<std::uint64_t>::max();
+  std::lock_guard<hpx::lcos::local::spinlock> lk(lua_holders_mtx);
+  for(auto i=lua_holders.begin();i != lua_holders.end();++i) {
+    const std::uint64_t e = (*i)->registry_epoch.load();
+    if(e != 0 && e < oldest)
+      oldest = e;
+  }
+  return oldest;
+}
+
+Lua *take_overflow_lua() {
+    if(lua_overflow_size == 0)
+      return nullptr;
+    std::lock_guard<hpx::lcos::local::spinlock> lk(lua_overflow_mtx);
+    if(lua_overflow.empty())
+      return nullptr;
+    Lua *lua = lua_overflow.back();
+    lua_overflow.pop_back();
+    lua_overflow_size = lua_overflow.size();
+    return lua;
+}
+
+bool give_overflow_lua(Lua *lua) {
+    std::lock_guard<hpx::lcos::local::spinlock> lk(lua_overflow_mtx);
+    if(lua_overflow.size() >= lua_pool_overflow_cap)
+      return false;
+    lua_overflow.push_back(lua);
+    lua_overflow_size = lua_overflow.size();
+    return true;
+}
+
 //--- Methods for getting/setting the Lua ptr. Ensures
 //--- that no two user threads has the same Lua VM.
 Lua *get_lua_ptr() {
-    LuaHolder *h = lua_ptr.get();
-    if(h == nullptr)
-      lua_ptr.reset(h = new LuaHolder());
-    Lua *lua = h->held;
-    if(lua == nullptr) {
-        lua = new Lua();
+    LuaHolder *h = get_lua_holder();
+    Lua *lua = nullptr;
+    if(h->count > 0) {
+      lua = h->held[--h->count];
+      h->hits++;
+    } else if((lua = take_overflow_lua()) != nullptr) {
+      h->overflow_hits++;
     } else {
-      h->held = nullptr;
-    }
-    lua_State *L = lua->get_state();
-    for(auto i=function_registry.begin();i != function_registry.end();++i) {
-      // Insert into table
-      if(lua_load(L,(lua_Reader)lua_read,(void *)&i->second,i->first.c_str(),"b") != 0) {
-        std::cout << "function " << i->first << " size=" << i->second.size() << std::endl;
-        SHOW_ERROR(L);
-      } else {
-        lua_setglobal(L,i->first.c_str());
-      }
+      h->misses++;
+      h->allocs++;
+      lua = new Lua();
     }
+    lua->sync_registry();
     return lua;
 }
 
 void set_lua_ptr(Lua *lua) {
-  LuaHolder *h = lua_ptr.get();
-  if(h == nullptr)
-    lua_ptr.reset(h = new LuaHolder());
-  Lua *l = h->held;
-  if(l == nullptr) {
-    h->held = lua;
-  } else {
+  // An idle VM does not keep large strings alive
+  lua->clear_shared_strings();
+  LuaHolder *h = get_lua_holder();
+  if(h->count < lua_pool_slots) {
+    h->held[h->count++] = lua;
+  } else if(!give_overflow_lua(lua)) {
+    h->frees++;
     delete lua;
   }
 }
 
+lua_pool_stats get_lua_pool_stats() {
+  std::lock_guard<hpx::lcos::local::spinlock> lk(lua_holders_mtx);
+  lua_pool_stats stats = lua_retired_stats;
+  for(auto i=lua_holders.begin();i != lua_holders.end();++i) {
+    stats.hits += (*i)->hits;
+    stats.overflow_hits += (*i)->overflow_hits;
+    stats.misses += (*i)->misses;
+    stats.allocs += (*i)->allocs;
+    stats.frees += (*i)->frees;
+  }
+  return stats;
+}
+
+void prewarm_worker(int n,hpx::lcos::local::latch *done) {
+  for(int i=0;i<n;i++) {
+    Lua *lua = new Lua();
+    get_lua_holder()->allocs++;
+    set_lua_ptr(lua);
+  }
+  done->count_down(1);
+}
+
+//--- Construct n VMs on each worker of this locality in parallel.
+//--- A task that gets stolen still adds its VMs to the pool: they
+//--- fill the free slots of the thread that runs it, and only what
+//--- does not fit there goes to the overflow list.
+int prewarm_lua_vms_local(int n) {
+  if(n <= 0)
+    return 0;
+  const std::size_t nthreads = hpx::get_os_thread_count();
+  hpx::lcos::local::latch done(nthreads+1);
+  for(std::size_t t=0;t<nthreads;t++) {
+    hpx::applier::register_work_nullary(
+      boost::bind(prewarm_worker,n,&done),"xlua_prewarm",
+      hpx::threads::pending,hpx::threads::thread_priority_normal,t);
+  }
+  done.count_down_and_wait();
+  return n*nthreads;
+}
+
+int xlua_pool_stats(lua_State *L) {
+  lua_pool_stats stats = get_lua_pool_stats();
+  lua_createtable(L,0,6);
+  lua_pushnumber(L,stats.hits);
+  lua_setfield(L,-2,"hits");
+  lua_pushnumber(L,stats.overflow_hits);
+  lua_setfield(L,-2,"overflow_hits");
+  lua_pushnumber(L,stats.misses);
+  lua_setfield(L,-2,"misses");
+  lua_pushnumber(L,stats.allocs);
+  lua_setfield(L,-2,"allocs");
+  lua_pushnumber(L,stats.frees);
+  lua_setfield(L,-2,"frees");
+  lua_pushnumber(L,lua_overflow_size);
+  lua_setfield(L,-2,"overflow");
+  return 1;
+}
+
+#ifdef XLUA_COUNT_HOLDERS
+std::atomic<std::size_t> holder_copies{0}, holder_moves{0};
+#endif
+
+holder_stats get_holder_stats() {
+  holder_stats stats;
+#ifdef XLUA_COUNT_HOLDERS
+  stats.copies = holder_copies.load(std::memory_order_relaxed);
+  stats.moves = holder_moves.load(std::memory_order_relaxed);
+#endif
+  return stats;
+}
+
+//--- Lua: holder_stats() returns a table of Holder copies and moves
+int xlua_holder_stats(lua_State *L) {
+  holder_stats stats = get_holder_stats();
+  lua_createtable(L,0,2);
+  lua_pushnumber(L,stats.copies);
+  lua_setfield(L,-2,"copies");
+  lua_pushnumber(L,stats.moves);
+  lua_setfield(L,-2,"moves");
+  return 1;
+}
+
 //---future data structure---//
 
 int new_future(lua_State *L) {
@@ -755,17 +2080,15 @@ int luax_wait_all(lua_State *L) {
 }
 
 ptr_type luax_when_all2(std::vector<future_type> result) {
-  ptr_type pt{new std::vector<Holder>};
+  ptr_type pt{make_pooled<holder_list>()};
   table_ptr t{new table_inner()};
   int n = 1;
   for(auto i=result.begin();i != result.end();++i) {
-    Holder h;
-    h.var = *i;
-    (t->t)[n++] = h;
+    (t->t)[std::int64_t(n++)].var = *i;
   }
   Holder h;
   h.var = t;
-  pt->push_back(h);
+  h.push(pt);
 
   return pt;
 }
@@ -810,20 +2133,20 @@ int luax_when_all(lua_State *L) {
 }
 
 ptr_type get_when_any_result(hpx::when_any_result< std::vector< future_type > > result) {
-  ptr_type p{new std::vector<Holder>()};
+  ptr_type p{make_pooled<holder_list>()};
   //Holder h;
   //h.var = result.index;
   //p->push_back(h);
   table_ptr t{new table_inner()};
-  (t->t)["index"].var = result.index+1;
+  (t->t)["index"].var = std::int64_t(result.index+1);
   table_ptr t2{new table_inner()};
   for(int i=0;i<result.futures.size();i++) {
-    (t2->t)[i+1].var = result.futures[i];
+    (t2->t)[std::int64_t(i+1)].var = result.futures[i];
   }
   (t->t)["futures"].var = t2;
   Holder h;
   h.var = t;
-  p->push_back(h);
+  h.push(p);
   return p;
 }
 
@@ -868,10 +2191,11 @@ int luax_when_any(lua_State *L) {
 
 const char *unwrapped_str = "**unwrapped**";
 
-closure_ptr getfunc(lua_State *L,int index) {
-  closure_ptr cl{new Closure};
+closure_ptr getfunc(lua_State *L,int index,pack_memo *memo = nullptr) {
+  closure_ptr cl{make_pooled<Closure>()};
   if(lua_isstring(L,index)) {
     cl->code.data = lua_tostring(L,index);
+    cl->fid = find_function_id(cl->code.data);
   } else if(lua_isfunction(L,index)) {
     lua_pushvalue(L,index);
     int n = lua_gettop(L);
@@ -881,16 +2205,16 @@ closure_ptr getfunc(lua_State *L,int index) {
       ClosureVar cv;
       cv.name = name;
       if(env != name) {
-        cv.val.pack(L,-1);
+        cv.val.pack(L,-1,memo);
       } else {
         cv.val.var = Empty();
       }
-      cl->vars.push_back(cv);
+      cl->vars.push_back(std::move(cv));
     }
     int n2 = lua_gettop(L);
     if(n2 > n) lua_pop(L,n2-n);
     assert(lua_isfunction(L,-1));
-    lua_dump(L,(lua_Writer)lua_write,&cl->code.data);
+    dump_function(L,-1,cl->code.data,&cl->code_hash);
     lua_pop(L,1);
   } else if(lua_istable(L,index)) {
     // this is intended to be used with unwrapped
@@ -911,20 +2235,22 @@ int hpx_future_then(lua_State *L) {
     //CHECK_STRING(2,"Future:Then()")
 
     // Package up the arguments
-    ptr_type args(new std::vector<Holder>());
-    string_ptr fname{new std::string};
-    closure_ptr cl = getfunc(L,2);
+    ptr_type args(make_pooled<holder_list>());
+    string_ptr fname{make_pooled<string_buf>()};
+    pack_memo memo;
+    memo.flatten = true;
+    closure_ptr cl = getfunc(L,2,&memo);
     *fname = cl->code.data;
     if(*fname == unwrapped_str) {
       Holder h;
-      h.pack(L,1);
+      h.pack(L,1,&memo);
       h.push(args);
       *fname = "call";
     }
     int nargs = lua_gettop(L);
     for(int i=3;i<=nargs;i++) {
       Holder h;
-      h.pack(L,i);
+      h.pack(L,i,&memo);
       h.push(args);
     }
     Holder h;
@@ -947,7 +2273,7 @@ int future_name(lua_State *L) {
 int open_future(lua_State *L) {
     static const struct luaL_Reg future_meta_funcs [] = {
         {"Get",&hpx_future_get},
-        {"Then",&hpx_future_then},
+        {"Then",&lua_packing<hpx_future_then>},
         {"Name",future_name},
         {NULL,NULL},
     };
@@ -960,6 +2286,7 @@ int open_future(lua_State *L) {
     luaL_newlib(L,future_funcs);
 
     luaL_newmetatable(L,future_metatable_name);
+    tag_metatable(L,future_metatable_name);
     luaL_newlib(L, future_meta_funcs);
     lua_setfield(L,-2,"__index");
 
@@ -1003,6 +2330,7 @@ int open_guard(lua_State *L) {
     luaL_newlib(L,guard_funcs);
 
     luaL_newmetatable(L,guard_metatable_name);
+    tag_metatable(L,guard_metatable_name);
     luaL_newlib(L, guard_meta_funcs);
     lua_setfield(L,-2,"__index");
 
@@ -1111,7 +2439,7 @@ int open_hpx(lua_State *L) {
     */
 
     static const struct luaL_Reg hpx_funcs [] = {
-        {"async",async},
+        {"async",lua_packing<async>},
         {"start",xlua_start},
         {"stop",xlua_stop},
         {"get_mtable",get_mtable},
@@ -1141,6 +2469,7 @@ int open_locality(lua_State *L) {
     luaL_newlib(L,locality_funcs);
 
     luaL_newmetatable(L,locality_metatable_name);
+    tag_metatable(L,locality_metatable_name);
     luaL_newlib(L, locality_meta_funcs);
     lua_setfield(L,-2,"__index");
 
@@ -1348,14 +2677,15 @@ int call(lua_State *L) {
   int argn = 1;
   if(cmp_meta(L,1,table_metatable_name)) {
     table_ptr& tp = *(table_ptr *)lua_touserdata(L,-1);
-    Holder hfunc = (tp->t)["func"];
+    static const atom func_atom("func"), args_atom("args");
+    Holder hfunc = (tp->t)[func_atom];
     hfunc.unpack(L);
     if(!loadFunc(L))
       return 0;
-    Holder hargs = (tp->t)["args"];
+    Holder hargs = (tp->t)[args_atom];
     table_ptr tpargs = boost::get<table_ptr>(hargs.var);
-    for(int i=1;i<=tpargs->size;i++) {
-      (tpargs->t)[i].unpack(L);
+    for(int i=1;i<=(int)tpargs->t.array_size();i++) {
+      (tpargs->t)[std::int64_t(i)].unpack(L);
       while(cmp_meta(L,-1,future_metatable_name)) {
         future_type *fc =
           (future_type *)lua_touserdata(L,-1);
@@ -1412,7 +2742,10 @@ ptr_type luax_dataflow2(
     string_ptr fname,
     ptr_type args,
     boost::shared_ptr<std::vector<ptr_type> > futs) {
-  ptr_type answers(new std::vector<Holder>());
+  ptr_type answers(make_pooled<holder_list>());
+
+  // Fetch missing frozen values before taking a VM
+  expand_frozen(*args);
 
   {
     LuaEnv lenv;
@@ -1424,14 +2757,23 @@ ptr_type luax_dataflow2(
     lua_pop(L,lua_gettop(L));
 
     if(is_bytecode(*fname)) {
-      if(lua_load(L,(lua_Reader)lua_read,(void *)fname.get(),0,"b") != 0) {
+      if(load_cached(L,*fname) != LUA_OK) {
         std::cout << "Error in function: size=" << fname->size() << std::endl;
         SHOW_ERROR(L);
+        return answers;
       }
     } else {
-      lua_getglobal(L,fname->c_str());
-      if(lua_isfunction(L,-1)) {
+      // Registered functions first, then globals (see README)
+      int id = find_function_id(*fname);
+      if(id >= 0 && lenv.get_lua()->push_function(id)) {
         found = true;
+      } else {
+        lua_getglobal(L,fname->c_str());
+        if(lua_isfunction(L,-1)) {
+          found = true;
+        } else {
+          lua_pop(L,1);
+        }
       }
       #if 0
       if(!found) {
@@ -1446,19 +2788,8 @@ ptr_type luax_dataflow2(
       #endif
 
       if(!found) {
-        if(function_registry.find(*fname) == function_registry.end()) {
-          std::cout << "Function '" << *fname << "' is not defined(3)." << std::endl;
-          return answers;
-        }
-
-        std::string bytecode = function_registry[*fname];
-        if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,fname->c_str(),"b") != 0) {
-          std::cout << "Error in function: '" << *fname << "' size=" << bytecode.size() << std::endl;
-          SHOW_ERROR(L);
-          return answers;
-        }
-
-        lua_setglobal(L,fname->c_str());
+        std::cout << "Function '" << *fname << "' is not defined(3)." << std::endl;
+        return answers;
       }
     }
 
@@ -1475,13 +2806,10 @@ ptr_type luax_dataflow2(
       }
     }
 
-    lua_getglobal(L,fname->c_str());
-    lua_insert(L,1);
-
     //std::ostringstream msg;
     //show_stack(msg,L,__LINE__);
     // Provide a maximum number output args
-    if(lua_pcall(L,args->size(),max_output_args,0) != 0) {
+    if(lua_pcall(L,lua_gettop(L)-1,max_output_args,0) != 0) {
       SHOW_ERROR(L);
       return answers;
     }
@@ -1493,9 +2821,11 @@ ptr_type luax_dataflow2(
       nargs--;
     }
 
+    pack_memo memo;
+    memo.flatten = true;
     for(int i=1;i<=nargs;i++) {
       Holder h;
-      h.pack(L,i);
+      h.pack(L,i,&memo);
       h.push(answers);
     }
     lua_pop(L,nargs);
@@ -1508,52 +2838,60 @@ ptr_type luax_dataflow2(
 ptr_type luax_async2(
     closure_ptr cl,
     ptr_type args) {
-  ptr_type answers(new std::vector<Holder>());
+  ptr_type answers(make_pooled<holder_list>());
+
+  // Fetch missing bytecode and frozen values before taking a VM
+  expand_closure(*cl);
+  expand_frozen(*cl);
+  expand_frozen(*args);
 
   {
     LuaEnv lenv;
 
     lua_State *L = lenv.get_state();
+    // Shared by the upvalues and the arguments, as when they were packed
+    unpack_memo args_memo;
 
     bool found = false;
 
     lua_pop(L,lua_gettop(L));
 
     if(is_bytecode(cl->code.data)) {
-      if(lua_load(L,(lua_Reader)lua_read,(void *)&cl->code.data,0,"b") != 0) {
+      // As in Holder::unpack, a closure with upvalues gets a function of
+      // its own: closures created by the call may share the upvalues.
+      // The hash is the one sent with a compacted closure, or the one
+      // the dump of a local task left.
+      int rc;
+      if(has_upvalues(cl->vars))
+        rc = lua_load(L,(lua_Reader)lua_read,(void *)&cl->code.data,0,"b");
+      else
+        rc = load_cached(L,cl->code.data,cl->hash != 0 ? cl->hash : cl->code_hash);
+      if(rc != LUA_OK) {
         std::cout << "Error in function: size=" << cl->code.data.size() << std::endl;
         SHOW_ERROR(L);
-      } else {
-        int findex = lua_gettop(L);
-        if(cl->vars.size() > 0) {
-          // Passing a closure
-          const int sz = cl->vars.size();
-          for(int n=0; n < sz;++n) {
-            ClosureVar& cv = cl->vars[n];
-            if(cv.name == "_ENV") {
-              lua_getglobal(L,"_G");
-            } else {
-              cv.val.unpack(L);
-            }
-            lua_setupvalue(L,findex,n+1);
-            cl->vars.push_back(cv);
-          }
-          lua_pop(L,lua_gettop(L)-findex);
-        }
+        return answers;
       }
+      bind_upvalues(L,lua_gettop(L),cl->vars,&args_memo);
     } else {
-      lua_getglobal(L,cl->code.data.c_str());
-      if(lua_isfunction(L,-1)) {
+      // Registered functions are found by ID, without hashing the name.
+      // A registered function takes precedence over a global of the
+      // same name in the VM (see README).
+      int id = cl->fid >= 0 ? cl->fid : find_function_id(cl->code.data);
+      if(id >= 0 && lenv.get_lua()->push_function(id)) {
         found = true;
       } else {
-        lua_pop(L,1);
+        lua_getglobal(L,cl->code.data.c_str());
+        if(lua_isfunction(L,-1)) {
+          found = true;
+        } else {
+          lua_pop(L,1);
+        }
       }
       if(!found) {
-        std::string skey = cl->code.data + "{s}";
         auto search = globals->t.find(cl->code.data);
         if(search != globals->t.end()) {
           if(search->second.var.which() == Holder::bytecode_t) {
-            Bytecode bytecode = boost::get<Bytecode>(search->second.var);
+            Bytecode& bytecode = boost::get<Bytecode>(search->second.var);
             int rc = lua_load(L,(lua_Reader)lua_read,(void *)&bytecode.data,0,"b");
             if(rc == LUA_OK) {
               found = true;
@@ -1565,26 +2903,14 @@ ptr_type luax_async2(
       }
 
       if(!found) {
-        if(function_registry.find(cl->code.data) == function_registry.end()) {
-          std::cout << "Function '" << cl->code.data << "' is not defined." << std::endl;
-          return answers;
-        }
-
-        std::string bytecode = function_registry[cl->code.data];
-        if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,cl->code.data.c_str(),"b") != 0) {
-          std::cout << "Error in function: '" << cl->code.data << "' size=" << bytecode.size() << std::endl;
-          SHOW_ERROR(L);
-          return answers;
-        }
-
-        lua_setglobal(L,cl->code.data.c_str());
-        lua_getglobal(L,cl->code.data.c_str());
+        std::cout << "Function '" << cl->code.data << "' is not defined." << std::endl;
+        return answers;
       }
     }
 
     // Push data from the concrete values and ready futures onto the Lua stack
     for(auto i=args->begin();i!=args->end();++i) {
-      i->unpack(L);
+      i->unpack(L,&args_memo);
     }
 
     const int max_output_args = 10;
@@ -1601,9 +2927,11 @@ ptr_type luax_async2(
       nargs--;
     }
 
+    pack_memo memo;
+    memo.flatten = true;
     for(int i=1;i<=nargs;i++) {
       Holder h;
-      h.pack(L,i);
+      h.pack(L,i,&memo);
       h.push(answers);
     }
     lua_pop(L,nargs);
@@ -1625,6 +2953,8 @@ future_type luax_dataflow(
 }
 
 int remote_reg(std::map<std::string,std::string> registry);
+std::string fetch_bytecode(std::uint64_t h);
+Holder fetch_frozen(std::uint64_t h);
 
 }
 
@@ -1633,13 +2963,224 @@ HPX_PLAIN_ACTION(hpx::luax_async2,luax_async_action);
 HPX_PLAIN_ACTION(hpx::remote_reg,remote_reg_action);
 HPX_REGISTER_BROADCAST_ACTION_DECLARATION(remote_reg_action);
 HPX_REGISTER_BROADCAST_ACTION(remote_reg_action);
+HPX_PLAIN_ACTION(hpx::prewarm_lua_vms_local,prewarm_lua_vms_action);
+HPX_REGISTER_BROADCAST_ACTION_DECLARATION(prewarm_lua_vms_action);
+HPX_REGISTER_BROADCAST_ACTION(prewarm_lua_vms_action);
+HPX_PLAIN_ACTION(hpx::fetch_bytecode,fetch_bytecode_action);
+HPX_PLAIN_ACTION(hpx::fetch_frozen,fetch_frozen_action);
 
 namespace hpx {
 
+//--- Restore the bytecode of a closure that arrived as a hash only.
+//--- Bytecode that arrives in full is remembered, and a hash that is
+//--- unknown here is fetched once from the sending locality. Throws
+//--- if the sender no longer has it, so the call's future carries
+//--- the error.
+void expand_closure(Closure& cl) {
+  if(cl.hash == 0)
+    return;
+  const bytecode_key key(cl.origin,cl.hash);
+  if(!cl.code.data.empty()) {
+    remember_bytecode(key,cl.code.data);
+    return;
+  }
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lk(bytecode_mtx);
+    const std::string *code = find_bytecode(key);
+    if(code != nullptr) {
+      cl.code.data = *code;
+      return;
+    }
+  }
+  hpx::naming::id_type origin = hpx::naming::get_id_from_locality_id(cl.origin);
+  cl.code.data = hpx::async<fetch_bytecode_action>(origin,cl.hash).get();
+  if(cl.code.data.empty()) {
+    std::ostringstream msg;
+    msg << "Bytecode " << cl.hash << " is unknown to locality " << cl.origin;
+    throw std::runtime_error(msg.str());
+  }
+  remember_bytecode(key,cl.code.data);
+}
+
+//--- Replace a value that arrived as a frozen_ref with the value,
+//--- from this locality's own frozen values, from the cache, or
+//--- fetched from the sending locality. Throws if the value cannot
+//--- be had; a failed fetch is not cached, so the next call tries
+//--- again.
+void expand_frozen(Holder& h) {
+  if(h.var.which() != Holder::frozen_t)
+    return;
+  const frozen_ref ref = boost::get<frozen_ref>(h.var);
+  const frozen_key key(ref.origin,ref.hash);
+  hpx::shared_future<Holder> value;
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lk(frozen_mtx);
+    // A value this locality sent, and got back
+    if(ref.origin == hpx::get_locality_id()) {
+      Holder stored = find_frozen(ref.hash);
+      if(stored.var.which() != Holder::empty_t) {
+        h = std::move(stored);
+        return;
+      }
+    }
+    auto search = frozen_index.find(key);
+    if(search != frozen_index.end()) {
+      frozen_lru.splice(frozen_lru.begin(),frozen_lru,search->second);
+      value = search->second->second;
+    } else {
+      hpx::naming::id_type origin = hpx::naming::get_id_from_locality_id(ref.origin);
+      const std::uint64_t hash = ref.hash;
+      value = hpx::async<fetch_frozen_action>(origin,hash).then(
+        [hash](hpx::future<Holder> f) {
+          Holder v = f.get();
+          // Every task here shares this value, so it stays frozen
+          freeze_value(v);
+          std::atomic<std::uint64_t> *frozen = frozen_field(v);
+          if(frozen != nullptr)
+            frozen->store(hash);
+          return v;
+        });
+      frozen_lru.push_front(std::make_pair(key,value));
+      frozen_index[key] = frozen_lru.begin();
+      while(frozen_lru.size() > frozen_cache_cap()) {
+        frozen_index.erase(frozen_lru.back().first);
+        frozen_lru.pop_back();
+      }
+    }
+  }
+  value.wait();
+  if(!value.has_exception() && value.get().var.which() != Holder::empty_t) {
+    h = value.get();
+    return;
+  }
+  {
+    std::lock_guard<hpx::lcos::local::spinlock> lk(frozen_mtx);
+    auto search = frozen_index.find(key);
+    if(search != frozen_index.end() && search->second->second.is_ready()) {
+      frozen_lru.erase(search->second);
+      frozen_index.erase(search);
+    }
+  }
+  if(value.has_exception())
+    value.get();
+  std::ostringstream msg;
+  msg << "Frozen value " << ref.hash << " is unknown to locality " << ref.origin;
+  throw std::runtime_error(msg.str());
+}
+
+void expand_frozen(holder_list& args) {
+  for(auto i=args.begin();i != args.end();++i)
+    expand_frozen(*i);
+}
+
+void expand_frozen(Closure& cl) {
+  for(auto i=cl.vars.begin();i != cl.vars.end();++i)
+    expand_frozen(i->val);
+}
+
+//--- Registrations still on their way to remote localities. Remote
+//--- calls issued while one is in flight are chained behind it, so
+//--- the callee has every function registered before the call.
+hpx::shared_future<void> registration_pending;
+//--- Localities that were sent the whole registry, so that only
+//--- changes need to follow. A locality drops out of it when a
+//--- registration on it fails, and gets the whole registry again.
+std::set<std::uint32_t> registration_known;
+hpx::lcos::local::spinlock registration_mtx;
+
+typedef std::vector<std::pair<hpx::naming::id_type,
+  std::map<std::string,std::string> > > registration_list;
+
+//--- Every registered function, for a locality that has none yet
+std::map<std::string,std::string> registry_snapshot() {
+  std::map<std::string,std::string> all;
+  registry_reader reader;
+  const function_table *ft = reader.get();
+  for(auto i=ft->functions.begin();i != ft->functions.end();++i) {
+    if(i->code)
+      all[i->name] = *i->code;
+  }
+  return all;
+}
+
+//--- Register functions on each locality and wait for all of them.
+//--- A failure is reported for its locality only, so it does not
+//--- stop this or any later registration on the other ones.
+void send_registration(const registration_list& sends) {
+  std::vector<hpx::future<void> > done;
+  for(auto i=sends.begin();i != sends.end();++i) {
+    const std::uint32_t id = hpx::naming::get_locality_id_from_id(i->first);
+    done.push_back(hpx::async<remote_reg_action>(i->first,i->second).then(
+      [id](hpx::future<int> f) {
+        try {
+          f.get();
+        } catch(std::exception const& e) {
+          std::cout << "ERROR: Registering functions on locality " << id
+            << " failed: " << e.what() << std::endl;
+          std::lock_guard<hpx::lcos::local::spinlock> lk(registration_mtx);
+          registration_known.erase(id);
+        }
+      }));
+  }
+  hpx::wait_all(done);
+}
+
+//--- Send registered functions to the localities after any earlier
+//--- registration, without waiting for either: delta to those that
+//--- already have the rest, and the whole registry to any other,
+//--- such as one that connected later.
+hpx::shared_future<void> broadcast_registration(
+    const std::vector<hpx::naming::id_type>& localities,
+    const std::map<std::string,std::string>& delta) {
+  const std::uint32_t here = hpx::get_locality_id();
+  std::lock_guard<hpx::lcos::local::spinlock> lk(registration_mtx);
+  if(!registration_pending.valid())
+    registration_pending = hpx::make_ready_future();
+  registration_list sends;
+  std::map<std::string,std::string> all;
+  bool have_all = false;
+  for(auto i=localities.begin();i != localities.end();++i) {
+    const std::uint32_t id = hpx::naming::get_locality_id_from_id(*i);
+    if(id == here)
+      continue;
+    if(registration_known.insert(id).second) {
+      if(!have_all) {
+        all = registry_snapshot();
+        have_all = true;
+      }
+      if(!all.empty())
+        sends.push_back(std::make_pair(*i,all));
+    } else if(!delta.empty()) {
+      sends.push_back(std::make_pair(*i,delta));
+    }
+  }
+  if(sends.empty())
+    return registration_pending;
+  registration_pending = registration_pending.then(hpx::launch::async,
+    [sends](hpx::shared_future<void>) {
+      send_registration(sends);
+    });
+  return registration_pending;
+}
+
+hpx::shared_future<void> registration_for(const hpx::naming::id_type& dest) {
+  std::vector<hpx::naming::id_type> localities(1,dest);
+  return broadcast_registration(localities,std::map<std::string,std::string>());
+}
+
+void prewarm_lua_vms() {
+  int n = std::atoi(hpx::get_config_entry("xlua.prewarm_vms","1").c_str());
+  if(n <= 0)
+    return;
+  std::vector<hpx::naming::id_type> localities = hpx::find_all_localities();
+  hpx::lcos::broadcast<prewarm_lua_vms_action>(localities,n).get();
+}
+
 int luax_run_guarded(lua_State *L) {
   int n = lua_gettop(L);
   CHECK_STRING(-1,"run_guarded")
-  string_ptr fname(new std::string(lua_tostring(L,-1)));
+  string_ptr fname{make_pooled<string_buf>()};
+  *fname = lua_tostring(L,-1);
   guard_type g;
   if(n == 1) {
     g = global_guarded;
@@ -1647,7 +3188,7 @@ int luax_run_guarded(lua_State *L) {
     g = *(guard_type *)lua_touserdata(L,-2);
   } else if(n > 2) {
     boost::shared_ptr<hpx::lcos::local::guard_set> gs{new hpx::lcos::local::guard_set()};
-    ptr_type all_data{new std::vector<Holder>()};
+    ptr_type all_data{make_pooled<holder_list>()};
 
     guard_type *gv = new guard_type[n];
     for(int i=1;i<n;i++) {
@@ -1656,7 +3197,7 @@ int luax_run_guarded(lua_State *L) {
       gs->add(g2->g);
       Holder h;
       h.var = g2->g_data;
-      all_data->push_back(h);
+      all_data->push_back(std::move(h));
     }
     boost::function<void()> func = boost::bind(hpx_srun,fname,all_data,gv,n);
     run_guarded(*gs,func);
@@ -1723,29 +3264,40 @@ int dataflow(lua_State *L) {
     }
 
     // Package up the arguments
-    ptr_type args(new std::vector<Holder>());
+    ptr_type args(make_pooled<holder_list>());
     int nargs = lua_gettop(L);
+    pack_memo memo;
+    memo.flatten = true;
     for(int i=2;i<=nargs;i++) {
       Holder h;
-      h.pack(L,i);
+      h.pack(L,i,&memo);
       h.push(args);
     }
     
-    string_ptr fname(new std::string);
+    string_ptr fname{make_pooled<string_buf>()};
     closure_ptr cl = getfunc(L,1);
     *fname = cl->code.data;
     if(*fname == unwrapped_str) {
       Holder h;
-      h.pack(L,1);
+      h.pack(L,1,&memo);
       h.push(args);
       *fname = "call";
     }
 
+    ptr_type keep(make_pooled<holder_list>());
+    if(loc != nullptr)
+      compact_frozen(*args,*loc,*keep);
+
     // Launch the thread
-    future_type f =
-      (loc == nullptr) ?
-        hpx::async(luax_dataflow,fname,args) :
-        hpx::async<luax_dataflow_action>(*loc,fname,args);
+    future_type f;
+    if(loc == nullptr) {
+      f = hpx::async(luax_dataflow,fname,args);
+    } else {
+      locality_type dest = *loc;
+      f = keep_frozen(after_registration(dest,[dest,fname,args]() {
+        return hpx::async<luax_dataflow_action>(dest,fname,args);
+      }),keep);
+    }
 
     new_future(L);
     future_type *fc =
@@ -1763,28 +3315,44 @@ int async(lua_State *L) {
     }
 
     // Package up the arguments
-    ptr_type args(new std::vector<Holder>());
+    ptr_type args(make_pooled<holder_list>());
     int nargs = lua_gettop(L);
     
     //CHECK_STRING(1,"async")
-    closure_ptr cl = getfunc(L,1);
+    // One memo for upvalues and arguments, so a table they share is
+    // sent once
+    pack_memo memo;
+    memo.flatten = true;
+    closure_ptr cl = getfunc(L,1,&memo);
     if(cl->code.data == unwrapped_str) {
       Holder h;
-      h.pack(L,1);
+      h.pack(L,1,&memo);
       h.push(args);
       cl->code.data = "call";
     }
     for(int i=2;i<=nargs;i++) {
       Holder h;
-      h.pack(L,i);
+      h.pack(L,i,&memo);
       h.push(args);
     }
 
+    ptr_type keep(make_pooled<holder_list>());
+    if(loc != nullptr) {
+      compact_closure(*cl,*loc);
+      compact_frozen(*cl,*loc,*keep);
+      compact_frozen(*args,*loc,*keep);
+    }
+
     // Launch the thread
-    future_type f =
-      (loc == nullptr) ?
-        hpx::async(luax_async2,cl,args) :
-        hpx::async<luax_async_action>(*loc,cl,args);
+    future_type f;
+    if(loc == nullptr) {
+      f = hpx::async(luax_async2,cl,args);
+    } else {
+      locality_type dest = *loc;
+      f = keep_frozen(after_registration(dest,[dest,cl,args]() {
+        return hpx::async<luax_async_action>(dest,cl,args);
+      }),keep);
+    }
 
     new_future(L);
     future_type *fc =
@@ -1818,19 +3386,8 @@ int unwrap(lua_State *L) {
 }
 
 int remote_reg(std::map<std::string,std::string> registry) {
-	LuaEnv lenv;
-    lua_State *L = lenv.get_state();
-	function_registry = registry;
-	for(auto i = registry.begin();i != registry.end();++i) {
-		std::string& bytecode = i->second;
-		if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,i->first.c_str(),"b") != 0) {
-			std::cout << "Error in function: " << i->first << " size=" << bytecode.size() << std::endl;
-			SHOW_ERROR(L);
-			return -1;
-		}
-
-		lua_setglobal(L,i->first.c_str());
-	}
+	register_functions(registry);
+	// VMs pick up the changes through sync_registry() when acquired
 	return 0;
 }
 
@@ -1841,6 +3398,7 @@ int remote_reg(std::map<std::string,std::string> registry) {
 // The first is a script, the second a lib (named either power.so or libpower.so),
 // the third a function. 
 int hpx_reg(lua_State *L) {
+	std::map<std::string,std::string> delta;
 	while(lua_gettop(L)>0) {
     CHECK_STRING(-1,"HPX_PLAIN_ACTION")
 		if(lua_isstring(L,-1)) {
@@ -1848,8 +3406,11 @@ int hpx_reg(lua_State *L) {
 			std::string fname = lua_tostring(L,-1);
 			lua_getglobal(L,fname.c_str());
       Bytecode bc;
-			lua_dump(L,(lua_Writer)lua_write,&bc.data);
-			function_registry[fname]=bc.data;
+			dump_function(L,-1,bc.data);
+			boost::shared_ptr<const std::string> prev = find_function(fname);
+			if(prev == nullptr || *prev != bc.data)
+				delta[fname] = bc.data;
+			register_function(fname,bc.data);
       (globals->t)[fname].var = bc;
 			//std::cout << "register(" << fname << "):size=" << bytecode.size() << std::endl;
 			const int nf = lua_gettop(L);
@@ -1860,12 +3421,24 @@ int hpx_reg(lua_State *L) {
 		lua_pop(L,1);
 	}
 
+	// Only new or changed functions are sent, except to localities
+	// that have none yet, and the caller gets a future instead of
+	// waiting for the remote localities.
 	std::vector<hpx::naming::id_type> remote_localities = hpx::find_remote_localities();
-  if(remote_localities.size() > 0) {
-    auto f = hpx::lcos::broadcast<remote_reg_action>(remote_localities,function_registry);
-    f.get(); // in case there are exceptions
-  }
-  
+	future_type f;
+	if(remote_localities.size() > 0) {
+		f = broadcast_registration(remote_localities,delta).then(
+			[](hpx::shared_future<void> r) {
+				r.get(); // in case there are exceptions
+				return ptr_type(make_pooled<holder_list>());
+			});
+	} else {
+		f = hpx::make_ready_future(ptr_type(make_pooled<holder_list>()));
+	}
+
+	new_future(L);
+	future_type *fc = (future_type *)lua_touserdata(L,-1);
+	*fc = f;
 	return 1;
 }
 
@@ -1908,14 +3481,14 @@ int hpx_run(lua_State *L) {
 
 int hpx_srun(lua_State *L,std::string& fname,ptr_type gdata) {
   int n = lua_gettop(L);
-  if(function_registry.find(fname) == function_registry.end()) {
+  boost::shared_ptr<const std::string> bytecode = find_function(fname);
+  if(bytecode == nullptr) {
     std::cout << "Function '" << fname << "' is not defined(2)." << std::endl;
     return 0;
   }
 
-  std::string bytecode = function_registry[fname];
-  if(lua_load(L,(lua_Reader)lua_read,(void *)&bytecode,0,"b") != 0) {
-    std::cout << "Error in function: " << fname << " size=" << bytecode.size() << std::endl;
+  if(lua_load(L,(lua_Reader)lua_read,(void *)bytecode.get(),0,"b") != 0) {
+    std::cout << "Error in function: " << fname << " size=" << bytecode->size() << std::endl;
     SHOW_ERROR(L);
     return 0;
   }
@@ -1934,7 +3507,7 @@ int hpx_srun(lua_State *L,std::string& fname,ptr_type gdata) {
 }
 
 int make_ready_future(lua_State *L) {
-  ptr_type pt{new std::vector<Holder>};
+  ptr_type pt{make_pooled<holder_list>()};
   int nargs = lua_gettop(L);
   for(int i=1;i<=nargs;i++) {
     Holder h;
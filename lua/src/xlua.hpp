@@ -6,6 +6,7 @@
 #include <hpx/hpx_init.hpp>
 #include <lua.hpp>
 #include <map>
+#include <set>
 #include <sstream>
 #include <hpx/include/lcos.hpp>
 #include <atomic>
@@ -17,10 +18,17 @@
 #include <hpx/lcos/local/composable_guard.hpp>
 #include <hpx/include/actions.hpp>
 #include <hpx/runtime/serialization/shared_ptr.hpp>
+#include <hpx/runtime/serialization/intrusive_ptr.hpp>
+#include <hpx/util/thread_specific_ptr.hpp>
+#include <boost/intrusive_ptr.hpp>
 #include <hpx/runtime/serialization/map.hpp>
 #include <hpx/runtime/serialization/vector.hpp>
 #include <hpx/runtime/serialization/variant.hpp>
+#include <hpx/runtime/serialization/array.hpp>
 #include <stdexcept>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 
 #define SHOW_ERROR(L) do { std::cout \
     << "Error: " << __FILE__ << ":" << __LINE__ << " " \
@@ -62,24 +70,314 @@ private:
     }
 };
 
-typedef boost::shared_ptr<std::vector<Holder> > ptr_type;
+//--- Objects that are recycled instead of freed. Each OS thread keeps
+//--- a small free list per type; make_pooled() takes from it, and
+//--- dropping the last boost::intrusive_ptr to an object puts the
+//--- object back, keeping any capacity it had. Types derive from
+//--- pooled<T> and provide reset_pooled() to clear their contents.
+const std::size_t pool_free_list_cap = 64;
+
+template<typename T>
+struct free_list {
+  std::vector<T *> items;
+  ~free_list() {
+    for(auto i=items.begin();i != items.end();++i)
+      delete *i;
+  }
+};
+
+template<typename T>
+hpx::util::thread_specific_ptr<free_list<T>,T>& free_list_ptr() {
+  static hpx::util::thread_specific_ptr<free_list<T>,T> ptr;
+  return ptr;
+}
+
+template<typename T>
+T *make_pooled() {
+  free_list<T> *fl = free_list_ptr<T>().get();
+  if(fl != nullptr && !fl->items.empty()) {
+    T *t = fl->items.back();
+    fl->items.pop_back();
+    return t;
+  }
+  return new T();
+}
+
+template<typename T>
+void recycle_pooled(T *t) {
+  free_list<T> *fl = free_list_ptr<T>().get();
+  if(fl == nullptr)
+    free_list_ptr<T>().reset(fl = new free_list<T>());
+  if(fl->items.size() < pool_free_list_cap) {
+    t->reset_pooled();
+    fl->items.push_back(t);
+  } else {
+    delete t;
+  }
+}
+
+template<typename T>
+struct pooled {
+  std::atomic<int> use_count;
+  pooled() : use_count(0) {}
+  pooled(const pooled&) : use_count(0) {}
+  pooled& operator=(const pooled&) { return *this; }
+
+  friend void intrusive_ptr_add_ref(T *t) {
+    t->use_count.fetch_add(1,std::memory_order_relaxed);
+  }
+  friend void intrusive_ptr_release(T *t) {
+    if(t->use_count.fetch_sub(1,std::memory_order_acq_rel) == 1)
+      recycle_pooled(t);
+  }
+};
+
+struct holder_list;
+typedef boost::intrusive_ptr<holder_list> ptr_type;
 typedef hpx::shared_future<ptr_type> future_type;
-typedef boost::variant<double,std::string> key_type;
-typedef std::map<key_type,Holder> table_type;
-typedef boost::shared_ptr<std::vector<double> > vector_ptr;
+// A Lua boolean. Kept in a struct so that pointers and string
+// literals assigned to a variant do not silently become booleans.
+struct lua_bool {
+  bool value = false;
+  lua_bool() {}
+  explicit lua_bool(bool value_) : value(value_) {}
+  bool operator==(const lua_bool& b) const { return value == b.value; }
+  bool operator<(const lua_bool& b) const { return value < b.value; }
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & value;
+    }
+};
+
+//--- A string interned once per process, used for table keys. Equal
+//--- atoms share one entry, so atoms are compared as pointers. The
+//--- empty string has no entry. Entries are never freed: every
+//--- distinct key string stays interned for the life of the process.
+//--- The table is split by hash into atom_shards parts, each with its
+//--- own lock, so threads interning different strings, as when
+//--- unpacking received tables, rarely wait for each other.
+class atom {
+public:
+  typedef std::pair<const std::string,std::size_t> entry;
+  atom() {}
+  atom(const std::string& s) : p(intern(s.data(),s.size())) {}
+  atom(const char *s) : p(intern(s,std::strlen(s))) {}
+  atom(const char *s,std::size_t n) : p(intern(s,n)) {}
+  const std::string& str() const;
+  std::size_t hash() const { return p == nullptr ? 0 : p->second; }
+  // The address that identifies an atom, and back
+  const void *id() const { return p; }
+  static atom from_id(const void *id) {
+    atom a;
+    a.p = (const entry *)id;
+    return a;
+  }
+  bool operator==(const atom& a) const { return p == a.p; }
+  bool operator<(const atom& a) const { return p != a.p && str() < a.str(); }
+private:
+  const entry *p = nullptr;
+  static const entry *intern(const char *s,std::size_t n);
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void save(Archive & ar, const unsigned int version) const
+    {
+      ar << str();
+    }
+  template<class Archive>
+    void load(Archive & ar, const unsigned int version)
+    {
+      std::string s;
+      ar >> s;
+      p = intern(s.data(),s.size());
+    }
+  HPX_SERIALIZATION_SPLIT_MEMBER()
+};
+std::ostream& operator<<(std::ostream& o,const atom& a);
+
+typedef boost::variant<double,atom,std::int64_t,lua_bool> key_type;
+enum key_kind { num_key, str_key, int_key, bool_key };
+
+// Hash of a table key, for the hash part of table_type
+inline std::uint64_t key_hash(const key_type& k) {
+  std::uint64_t h = 0;
+  switch(k.which()) {
+    case num_key:
+      {
+        double d = boost::get<double>(k);
+        std::memcpy(&h,&d,sizeof(h));
+      }
+      break;
+    case str_key:
+      h = boost::get<atom>(k).hash();
+      break;
+    case int_key:
+      h = std::uint64_t(boost::get<std::int64_t>(k));
+      break;
+    case bool_key:
+      h = boost::get<lua_bool>(k).value;
+      break;
+  }
+  // Mix the bits, so that runs of integers spread over the slots
+  h ^= std::uint64_t(k.which()) << 60;
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  return h;
+}
+
+struct table_slot;
+struct table_entry;
+
+//--- Storage of table_t, laid out like Lua's own tables. Values for
+//--- the integer keys 1..n are kept in order in a contiguous array
+//--- part; all other keys are in an open addressing hash part with
+//--- linear probing. Entries are never removed (assigning nil stores
+//--- an empty Holder), and a key n+1 that is added to the hash part
+//--- is moved to the array part as soon as 1..n are all present.
+//--- Member functions are defined after Holder.
+class table_type {
+public:
+  class iterator;
+  iterator begin();
+  iterator end();
+  iterator find(const key_type& k);
+  Holder& operator[](const key_type& k);
+  Holder& operator[](key_type&& k);
+  // Number of entries in the array part: the length of the table
+  std::size_t array_size() const { return arr.size(); }
+  std::size_t size() const { return arr.size() + used; }
+private:
+  friend class iterator;
+  std::vector<Holder> arr;
+  // Hash part. Its size is 0 or a power of two, at most 3/4 used.
+  std::vector<table_slot> slots;
+  std::size_t used = 0;
+  std::size_t slot_of(const key_type& k) const;
+  std::size_t find_slot(const key_type& k) const;
+  Holder& insert_hash(key_type&& k);
+  Holder& append();
+  void grow();
+  void erase_slot(std::size_t i);
+
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void save(Archive & ar, const unsigned int version) const;
+  template<class Archive>
+    void load(Archive & ar, const unsigned int version);
+  HPX_SERIALIZATION_SPLIT_MEMBER()
+};
+
+// Key for a number. Integral values are always stored as integers,
+// so that t[1] and t[1.0] are the same entry.
+inline key_type number_key(double d) {
+  if(d >= -9007199254740992.0 && d <= 9007199254740992.0 &&
+      d == double(std::int64_t(d)))
+    return key_type(std::int64_t(d));
+  return key_type(d);
+}
+
+// Storage of vector_t. The doubles are written as a single binary
+// chunk rather than one element at a time.
+struct vector_data : std::vector<double> {
+  // Content hash once frozen (see freeze_value()), 0 while mutable.
+  // Atomic because senders on several threads may hash it at once.
+  std::atomic<std::uint64_t> frozen{0};
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void save(Archive & ar, const unsigned int version) const
+    {
+      std::uint64_t n = size();
+      ar << n;
+      if(n > 0)
+        ar << hpx::serialization::make_array(data(),n);
+    }
+  template<class Archive>
+    void load(Archive & ar, const unsigned int version)
+    {
+      std::uint64_t n = 0;
+      ar >> n;
+      resize(n);
+      if(n > 0)
+        ar >> hpx::serialization::make_array(data(),n);
+    }
+  HPX_SERIALIZATION_SPLIT_MEMBER()
+};
+typedef boost::shared_ptr<vector_data> vector_ptr;
+
+// Elements 1..n of a native Lua table whose values are all numbers,
+// stored from index 0. Unpacked as a native table again.
+struct dense_data : vector_data {};
+typedef boost::shared_ptr<dense_data> dense_ptr;
+
+// A native Lua table that holds only numbers, strings, booleans and
+// other such tables, encoded straight from the Lua stack into bytes
+// and decoded straight into a Lua table (see stream_value()).
+struct stream_data {
+  std::string bytes;
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & bytes;
+    }
+};
+typedef boost::shared_ptr<stream_data> stream_ptr;
+
+// A string of at least shared_string_min bytes. Every Holder copied
+// from the one that packed it shares the same bytes, which are never
+// modified after construction. A VM turns it into a Lua string only
+// once (see Lua::push_shared_string()).
+const std::size_t shared_string_min = 1024;
+struct shared_string {
+  shared_string() {}
+  explicit shared_string(std::string&& data_) : data(std::move(data_)) {}
+  const std::string& str() const { return data; }
+private:
+  std::string data;
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & data;
+    }
+};
+typedef boost::shared_ptr<shared_string> shared_string_ptr;
+
+// A frozen table_t or vector_t sent by content hash. The receiver
+// keeps recently used frozen values and fetches the value from
+// origin only when it has no copy (see expand_frozen()).
+struct frozen_ref {
+  std::uint64_t hash = 0;
+  std::uint32_t origin = 0;
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & hash;
+      ar & origin;
+    }
+};
 struct table_inner {
   table_inner() {}
   table_inner(const table_type* t_) : t(*t_) {}
 
   table_type t;
-  int size = 0;
+  // Content hash once frozen (see freeze_value()), 0 while mutable.
+  // Not serialized: the receiver marks the values it caches itself.
+  // Atomic because senders on several threads may hash it at once.
+  std::atomic<std::uint64_t> frozen{0};
 private:
   friend class hpx::serialization::access;
   template<class Archive>
     void serialize(Archive & ar, const unsigned int version)
     {
       ar & t;
-      ar & size;
     }
 };
 
@@ -92,9 +390,21 @@ private:
     }
 };
 class ClosureVar;
-struct Closure {
+struct Closure : pooled<Closure> {
   std::vector<ClosureVar> vars;
   Bytecode code;
+  // ID of the registered function named by code, resolved by the
+  // caller. Only meaningful on the locality that resolved it, so
+  // it is not serialized and remote receivers fall back to the name.
+  int fid = -1;
+  // bytecode_hash() of code when the caller already had it from
+  // dump_function(), else 0. Not serialized either.
+  std::uint64_t code_hash = 0;
+  // Hash of the bytecode and the locality id of the sender. Once a
+  // receiver is known to have the bytecode, code is sent empty and
+  // the receiver looks it up by hash (see compact_closure()).
+  std::uint64_t hash = 0;
+  std::uint32_t origin = 0;
 private:
     friend class hpx::serialization::access;
     template<class Archive>
@@ -102,9 +412,13 @@ private:
     {
       ar & vars;
       ar & code;
+      ar & hash;
+      ar & origin;
     }
+public:
+  void reset_pooled();
 };
-typedef boost::shared_ptr<Closure> closure_ptr;
+typedef boost::intrusive_ptr<Closure> closure_ptr;
 typedef boost::shared_ptr<table_inner> table_ptr;
 
 struct lua_aux_client {
@@ -112,11 +426,11 @@ struct lua_aux_client {
 
   lua_aux_client() {}
 
-  hpx::future<ptr_type> get(std::string name);
+  hpx::future<ptr_type> get(atom name);
 
   hpx::future<ptr_type> call(closure_ptr cp,ptr_type ptargs);
 
-  hpx::future<ptr_type> set(std::string name,Holder h);
+  hpx::future<ptr_type> set(atom name,Holder h);
 private:
   friend class hpx::serialization::access;
   template<class Archive>
@@ -136,64 +450,635 @@ typedef boost::variant<
   vector_ptr,
   hpx::naming::id_type,
   lua_aux_client,
-  closure_ptr
+  closure_ptr,
+  dense_ptr,
+  stream_ptr,
+  std::int64_t,
+  lua_bool,
+  shared_string_ptr,
+  frozen_ref
   > variant_type;
 
-struct table_iter_type {
-  bool ready = false;
-  table_type::iterator begin, end;
-};
-
 typedef std::vector<Holder> array_type;
 
 struct Guard {
   boost::shared_ptr<hpx::lcos::local::guard> g;
   ptr_type g_data;
-  Guard() : g(new hpx::lcos::local::guard()), g_data(new std::vector<Holder>()) {}
+  Guard();
   ~Guard() {}
 };
 typedef boost::shared_ptr<Guard> guard_type;
 
-typedef boost::shared_ptr<std::string> string_ptr;
+struct string_buf : std::string, pooled<string_buf> {
+  using std::string::operator=;
+  void reset_pooled() { clear(); }
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & static_cast<std::string&>(*this);
+    }
+};
+typedef boost::intrusive_ptr<string_buf> string_ptr;
 
 int hpx_srun(lua_State *L,std::string& fname,ptr_type p);
 void hpx_srun(string_ptr fname,ptr_type p,guard_type*,int);
 
 extern guard_type global_guarded;
 
+struct pack_memo;
+struct unpack_memo;
+
+//--- Copies and moves of Holders, for checking that the marshalling
+//--- path moves values. Only counted when built with XLUA_COUNT_HOLDERS.
+struct holder_stats {
+  std::size_t copies = 0;
+  std::size_t moves = 0;
+};
+holder_stats get_holder_stats();
+#ifdef XLUA_COUNT_HOLDERS
+extern std::atomic<std::size_t> holder_copies, holder_moves;
+#define XLUA_COUNT_HOLDER(c) c.fetch_add(1,std::memory_order_relaxed)
+#else
+#define XLUA_COUNT_HOLDER(c)
+#endif
+
+//--- Wire format of a Holder. Each value starts with one tag byte:
+//--- the low 5 bits are the kind (a Holder::utype or one of the
+//--- compact encodings below), the high 3 bits the format version.
+//--- Lengths and small integers are varints. Only shared_ptr values
+//--- (tables, vectors, closures, argument lists) go through HPX's
+//--- pointer tracking.
+const unsigned char holder_wire_version = 1;
+const unsigned char holder_kind_int = 24; // integral double as zigzag varint
+const unsigned char holder_kind_false = 25;
+const unsigned char holder_kind_true = 26;
+
+template<class Archive>
+void put_varint(Archive& ar,std::uint64_t v) {
+  unsigned char buf[10];
+  std::size_t n = 0;
+  do {
+    unsigned char b = v & 0x7f;
+    v >>= 7;
+    if(v != 0) b |= 0x80;
+    buf[n++] = b;
+  } while(v != 0);
+  ar << hpx::serialization::make_array(buf,n);
+}
+
+template<class Archive>
+std::uint64_t get_varint(Archive& ar) {
+  std::uint64_t v = 0;
+  unsigned char b = 0;
+  for(int shift=0;shift < 64;shift += 7) {
+    ar >> b;
+    v |= std::uint64_t(b & 0x7f) << shift;
+    if((b & 0x80) == 0)
+      break;
+  }
+  return v;
+}
+
+template<class Archive>
+void put_bytes(Archive& ar,const std::string& s) {
+  put_varint(ar,s.size());
+  if(s.size() > 0)
+    ar << hpx::serialization::make_array(s.data(),s.size());
+}
+
+template<class Archive>
+void get_bytes(Archive& ar,std::string& s) {
+  s.resize(get_varint(ar));
+  if(s.size() > 0)
+    ar >> hpx::serialization::make_array(&s[0],s.size());
+}
+
 //--- Generic holder for a Lua data object
 class Holder {
 private:
     friend class hpx::serialization::access;
     template<class Archive>
-    void serialize(Archive & ar, const unsigned int version)
+    void put_tag(Archive & ar,unsigned char kind) const
+    {
+      unsigned char tag = (holder_wire_version << 5) | kind;
+      ar << tag;
+    }
+    template<class T,class Archive>
+    void load_as(Archive & ar)
     {
-      ar & var;
+      T t;
+      ar >> t;
+      var = t;
     }
+    template<class Archive>
+    void save(Archive & ar, const unsigned int version) const
+    {
+      const unsigned char kind = var.which();
+      switch(kind) {
+        case empty_t:
+          put_tag(ar,kind);
+          break;
+        case num_t:
+          {
+            double d = boost::get<double>(var);
+            // Doubles that hold exact integers, as most Lua numbers
+            // do, are sent as varints. -0.0 keeps its sign bit.
+            if(d >= -9007199254740992.0 && d <= 9007199254740992.0 &&
+                d == double(std::int64_t(d)) && !(d == 0 && std::signbit(d))) {
+              std::int64_t i = std::int64_t(d);
+              put_tag(ar,holder_kind_int);
+              put_varint(ar,(std::uint64_t(i) << 1) ^ std::uint64_t(i >> 63));
+            } else {
+              put_tag(ar,kind);
+              ar << d;
+            }
+          }
+          break;
+        case str_t:
+          put_tag(ar,kind);
+          put_bytes(ar,boost::get<std::string>(var));
+          break;
+        case bytecode_t:
+          put_tag(ar,kind);
+          put_bytes(ar,boost::get<Bytecode>(var).data);
+          break;
+        case fut_t:
+          put_tag(ar,kind);
+          ar << boost::get<future_type>(var);
+          break;
+        case ptr_t:
+          put_tag(ar,kind);
+          ar << boost::get<ptr_type>(var);
+          break;
+        case table_t:
+          put_tag(ar,kind);
+          ar << boost::get<table_ptr>(var);
+          break;
+        case vector_t:
+          put_tag(ar,kind);
+          ar << boost::get<vector_ptr>(var);
+          break;
+        case locality_t:
+          put_tag(ar,kind);
+          ar << boost::get<hpx::naming::id_type>(var);
+          break;
+        case client_t:
+          put_tag(ar,kind);
+          ar << boost::get<lua_aux_client>(var);
+          break;
+        case closure_t:
+          put_tag(ar,kind);
+          ar << boost::get<closure_ptr>(var);
+          break;
+        case dense_t:
+          put_tag(ar,kind);
+          ar << boost::get<dense_ptr>(var);
+          break;
+        case stream_t:
+          put_tag(ar,kind);
+          ar << boost::get<stream_ptr>(var);
+          break;
+        case int_t:
+          {
+            std::int64_t i = boost::get<std::int64_t>(var);
+            put_tag(ar,kind);
+            put_varint(ar,(std::uint64_t(i) << 1) ^ std::uint64_t(i >> 63));
+          }
+          break;
+        case bool_t:
+          put_tag(ar,boost::get<lua_bool>(var).value ? holder_kind_true : holder_kind_false);
+          break;
+        case shared_str_t:
+          put_tag(ar,kind);
+          ar << boost::get<shared_string_ptr>(var);
+          break;
+        case frozen_t:
+          put_tag(ar,kind);
+          ar << boost::get<frozen_ref>(var);
+          break;
+      }
+    }
+    template<class Archive>
+    void load(Archive & ar, const unsigned int version)
+    {
+      unsigned char tag = 0;
+      ar >> tag;
+      if((tag >> 5) != holder_wire_version) {
+        HPX_THROW_EXCEPTION(hpx::serialization_error,"Holder::load",
+          "unsupported Holder wire format version");
+      }
+      switch(tag & 0x1f) {
+        case empty_t:
+          var = Empty();
+          break;
+        case holder_kind_int:
+          {
+            std::uint64_t u = get_varint(ar);
+            std::int64_t i = std::int64_t(u >> 1) ^ -std::int64_t(u & 1);
+            var = double(i);
+          }
+          break;
+        case num_t:
+          load_as<double>(ar);
+          break;
+        case str_t:
+          {
+            std::string s;
+            get_bytes(ar,s);
+            var = s;
+          }
+          break;
+        case bytecode_t:
+          {
+            Bytecode bc;
+            get_bytes(ar,bc.data);
+            var = bc;
+          }
+          break;
+        case fut_t:
+          load_as<future_type>(ar);
+          break;
+        case ptr_t:
+          load_as<ptr_type>(ar);
+          break;
+        case table_t:
+          load_as<table_ptr>(ar);
+          break;
+        case vector_t:
+          load_as<vector_ptr>(ar);
+          break;
+        case locality_t:
+          load_as<hpx::naming::id_type>(ar);
+          break;
+        case client_t:
+          load_as<lua_aux_client>(ar);
+          break;
+        case closure_t:
+          load_as<closure_ptr>(ar);
+          break;
+        case dense_t:
+          load_as<dense_ptr>(ar);
+          break;
+        case stream_t:
+          load_as<stream_ptr>(ar);
+          break;
+        case int_t:
+          {
+            std::uint64_t u = get_varint(ar);
+            var = std::int64_t(u >> 1) ^ -std::int64_t(u & 1);
+          }
+          break;
+        case holder_kind_false:
+          var = lua_bool(false);
+          break;
+        case holder_kind_true:
+          var = lua_bool(true);
+          break;
+        case shared_str_t:
+          load_as<shared_string_ptr>(ar);
+          break;
+        case frozen_t:
+          load_as<frozen_ref>(ar);
+          break;
+        default:
+          HPX_THROW_EXCEPTION(hpx::serialization_error,"Holder::load",
+            "unknown Holder type tag");
+      }
+    }
+    HPX_SERIALIZATION_SPLIT_MEMBER()
 public:
-  enum utype { empty_t, num_t, fut_t, str_t, ptr_t, table_t, bytecode_t, vector_t, locality_t, client_t, closure_t };
+  enum utype { empty_t, num_t, fut_t, str_t, ptr_t, table_t, bytecode_t, vector_t, locality_t, client_t, closure_t, dense_t, stream_t, int_t, bool_t, shared_str_t, frozen_t };
 
   variant_type var;
 
+  Holder() {}
+  Holder(const Holder& h) : var(h.var) {
+    XLUA_COUNT_HOLDER(holder_copies);
+  }
+  Holder(Holder&& h) noexcept : var(std::move(h.var)) {
+    XLUA_COUNT_HOLDER(holder_moves);
+  }
+  Holder& operator=(const Holder& h) {
+    var = h.var;
+    XLUA_COUNT_HOLDER(holder_copies);
+    return *this;
+  }
+  Holder& operator=(Holder&& h) noexcept {
+    var = std::move(h.var);
+    XLUA_COUNT_HOLDER(holder_moves);
+    return *this;
+  }
+
   void set(double num_) {
     var = num_;
   }
-  void set(std::string& str_) {
+  void set(std::int64_t num_) {
+    var = num_;
+  }
+  void set(bool b_) {
+    var = lua_bool(b_);
+  }
+  void set(const std::string& str_) {
     var = str_;
   }
-  void set(Bytecode& bc_) {
+  void set(std::string&& str_) {
+    var = std::move(str_);
+  }
+  void set(const Bytecode& bc_) {
     var = bc_;
   }
+  void set(Bytecode&& bc_) {
+    var = std::move(bc_);
+  }
   void set(const char *str_) {
-    std::string s(str_);
-    var = s;
+    var = std::string(str_);
+  }
+  void unpack(lua_State *L,unpack_memo *memo = nullptr);
+  // Moves this Holder onto the end of vec, leaving it empty
+  void push(ptr_type& vec);
+  void pack(lua_State *L,int index,pack_memo *memo = nullptr);
+  bool pack_stream(lua_State *L,int index);
+};
+
+//--- Argument and result lists
+struct holder_list : std::vector<Holder>, pooled<holder_list> {
+  void reset_pooled() { clear(); }
+private:
+  friend class hpx::serialization::access;
+  template<class Archive>
+    void serialize(Archive & ar, const unsigned int version)
+    {
+      ar & static_cast<std::vector<Holder>&>(*this);
+    }
+};
+
+inline void Holder::push(ptr_type& vec) {
+  if(var.which() != empty_t) {
+    vec->push_back(std::move(*this));
+    // A moved-from variant keeps its type, so reset it explicitly
+    var = Empty();
+  }
+}
+
+inline Guard::Guard()
+  : g(new hpx::lcos::local::guard()), g_data(make_pooled<holder_list>()) {}
+
+struct table_slot {
+  key_type key;
+  Holder val;
+  bool used = false;
+};
+
+//--- What a table_type::iterator points at, laid out like the
+//--- std::pair of a std::map entry
+struct table_entry {
+  const key_type& first;
+  Holder& second;
+  table_entry *operator->() { return this; }
+};
+
+//--- Visits the array part in order, then the used slots of the hash
+//--- part. Positions stay valid as the table grows, but entries
+//--- added during iteration may be skipped or seen twice.
+class table_type::iterator {
+  table_type *tab = nullptr;
+  std::size_t pos = end_pos;
+  key_type key;
+  static const std::size_t end_pos = ~std::size_t(0);
+  friend class table_type;
+  iterator(table_type *tab_,std::size_t pos_) : tab(tab_), pos(pos_) {
+    settle();
+  }
+  // Move to the first entry at or after pos
+  void settle() {
+    const std::size_t n = tab->arr.size();
+    if(pos < n) {
+      key = std::int64_t(pos+1);
+      return;
+    }
+    while(pos - n < tab->slots.size() && !tab->slots[pos - n].used)
+      pos++;
+    if(pos - n >= tab->slots.size())
+      pos = end_pos;
+  }
+public:
+  iterator() {}
+  table_entry operator*() const {
+    const std::size_t n = tab->arr.size();
+    if(pos < n)
+      return table_entry{key,tab->arr[pos]};
+    table_slot& s = tab->slots[pos - n];
+    return table_entry{s.key,s.val};
+  }
+  table_entry operator->() const { return **this; }
+  iterator& operator++() {
+    pos++;
+    settle();
+    return *this;
+  }
+  bool operator==(const iterator& i) const { return pos == i.pos; }
+  bool operator!=(const iterator& i) const { return pos != i.pos; }
+};
+
+struct table_iter_type {
+  bool ready = false;
+  table_type::iterator begin, end;
+};
+
+inline table_type::iterator table_type::begin() {
+  return iterator(this,0);
+}
+
+inline table_type::iterator table_type::end() {
+  return iterator();
+}
+
+inline std::size_t table_type::slot_of(const key_type& k) const {
+  return key_hash(k) & (slots.size()-1);
+}
+
+// Index of the slot holding k, or slots.size() if there is none
+inline std::size_t table_type::find_slot(const key_type& k) const {
+  if(used == 0)
+    return slots.size();
+  for(std::size_t i=slot_of(k);slots[i].used;i=(i+1) & (slots.size()-1)) {
+    if(slots[i].key == k)
+      return i;
+  }
+  return slots.size();
+}
+
+inline table_type::iterator table_type::find(const key_type& k) {
+  if(k.which() == int_key) {
+    std::int64_t i = boost::get<std::int64_t>(k);
+    if(i >= 1 && std::uint64_t(i) <= arr.size())
+      return iterator(this,std::size_t(i-1));
+  }
+  std::size_t i = find_slot(k);
+  if(i == slots.size())
+    return end();
+  return iterator(this,arr.size()+i);
+}
+
+inline Holder& table_type::operator[](const key_type& k) {
+  return (*this)[key_type(k)];
+}
+
+inline Holder& table_type::operator[](key_type&& k) {
+  if(k.which() == int_key) {
+    std::int64_t i = boost::get<std::int64_t>(k);
+    if(i >= 1 && std::uint64_t(i) <= arr.size())
+      return arr[i-1];
+    if(std::uint64_t(i) == arr.size()+1)
+      return append();
+  }
+  std::size_t i = find_slot(k);
+  if(i != slots.size())
+    return slots[i].val;
+  return insert_hash(std::move(k));
+}
+
+inline Holder& table_type::insert_hash(key_type&& k) {
+  if(4*(used+1) > 3*slots.size())
+    grow();
+  std::size_t i = slot_of(k);
+  while(slots[i].used)
+    i = (i+1) & (slots.size()-1);
+  slots[i].key = std::move(k);
+  slots[i].used = true;
+  used++;
+  return slots[i].val;
+}
+
+// Add key n+1 to the array part, then move the keys following it
+// out of the hash part. Key n+1 is never in the hash part itself.
+// Returns the new entry.
+inline Holder& table_type::append() {
+  arr.emplace_back();
+  const std::size_t n = arr.size();
+  while(used > 0) {
+    std::size_t i = find_slot(key_type(std::int64_t(arr.size()+1)));
+    if(i == slots.size())
+      break;
+    arr.push_back(std::move(slots[i].val));
+    erase_slot(i);
+  }
+  return arr[n-1];
+}
+
+inline void table_type::grow() {
+  std::vector<table_slot> old;
+  old.swap(slots);
+  slots.resize(old.empty() ? 8 : 2*old.size());
+  used = 0;
+  for(auto i=old.begin();i != old.end();++i) {
+    if(i->used)
+      insert_hash(std::move(i->key)) = std::move(i->val);
+  }
+}
+
+// Remove slot i, shifting later entries of its probe run back so
+// that lookups need no tombstones
+inline void table_type::erase_slot(std::size_t i) {
+  const std::size_t mask = slots.size()-1;
+  std::size_t j = i;
+  while(true) {
+    j = (j+1) & mask;
+    if(!slots[j].used)
+      break;
+    std::size_t home = slot_of(slots[j].key);
+    // Move j back to i unless its home lies cyclically in (i,j]
+    if(((j - home) & mask) >= ((j - i) & mask)) {
+      slots[i].key = std::move(slots[j].key);
+      slots[i].val = std::move(slots[j].val);
+      i = j;
+    }
+  }
+  slots[i].used = false;
+  slots[i].val = Holder();
+  used--;
+}
+
+// The array part is written as one run of values and read straight
+// into place; the hash part as key and value pairs.
+template<class Archive>
+void table_type::save(Archive & ar, const unsigned int version) const {
+  std::uint64_t n = arr.size();
+  ar << n;
+  for(auto i=arr.begin();i != arr.end();++i)
+    ar << *i;
+  std::uint64_t m = used;
+  ar << m;
+  for(auto i=slots.begin();i != slots.end();++i) {
+    if(i->used) {
+      ar << i->key;
+      ar << i->val;
+    }
+  }
+}
+
+template<class Archive>
+void table_type::load(Archive & ar, const unsigned int version) {
+  std::uint64_t n = 0, m = 0;
+  ar >> n;
+  arr.clear();
+  arr.resize(n);
+  for(auto i=arr.begin();i != arr.end();++i)
+    ar >> *i;
+  slots.clear();
+  used = 0;
+  ar >> m;
+  for(std::uint64_t i=0;i < m;i++) {
+    key_type k;
+    ar >> k;
+    ar >> (*this)[std::move(k)];
   }
-  void unpack(lua_State *L);
-  void push(ptr_type& vec) {
-    if(var.which() != empty_t)
-      vec->push_back(*this);
+}
+
+//--- Tables packed so far in one pack, keyed by lua_topointer(), so
+//--- a table reached twice is shared. open holds the tables whose
+//--- contents are being packed into a table_t; reaching one of those
+//--- again is a cycle, which table_t cannot hold without leaking, so
+//--- pack throws a pack_error.
+//--- flatten is set where values are marshalled for a call or its
+//--- results; only then may a native table be packed as plain data
+//--- that unpacks as a native table again. Elsewhere, as when it is
+//--- stored in a table_t, it becomes a shared table_t.
+struct pack_memo {
+  std::map<const void *,variant_type> seen;
+  std::set<const void *> open;
+  bool flatten = false;
+};
+
+//--- Thrown by Holder::pack for a value it cannot pack. The Lua
+//--- functions that pack their arguments are registered through
+//--- lua_packing<>, which raises it as a Lua error once the C++
+//--- frames between it and pack have been unwound. Elsewhere, as for
+//--- the results of a task, it fails the task's future.
+struct pack_error : std::runtime_error {
+  pack_error(const char *what) : std::runtime_error(what) {}
+};
+
+template<lua_CFunction F>
+int lua_packing(lua_State *L) {
+  try {
+    return F(L);
+  } catch(pack_error& e) {
+    lua_pushstring(L,e.what());
   }
-  void pack(lua_State *L,int index);
+  return lua_error(L);
+}
+
+//--- Lua values built so far in one unpack, keyed by the data they
+//--- came from, so shared data becomes one Lua value again.
+struct unpack_memo {
+  lua_State *L = nullptr;
+  std::map<const void *,int> refs;
+  ~unpack_memo();
+  bool push(lua_State *L_,const void *key);
+  void remember(lua_State *L_,const void *key);
 };
 
 struct ClosureVar {
@@ -211,7 +1096,36 @@ private:
 
 class Lua;
 
-extern std::map<std::string,std::string> function_registry;
+//--- Bytecode for a function registered with HPX_PLAIN_ACTION, and
+//--- the registry generation at which it was last added or changed.
+struct registered_function {
+  std::string name;
+  boost::shared_ptr<const std::string> code;
+  std::size_t generation = 0;
+};
+
+//--- Immutable snapshot of the function registry. Writers copy the
+//--- current snapshot, modify it and publish the copy. Readers use
+//--- the current one through a registry_reader, without a lock or a
+//--- shared count; a replaced snapshot is freed by a later
+//--- registration once no reader can still be using it. Copies share
+//--- the bytecode strings, so a copy costs one entry per function.
+//--- A function keeps its ID (its index in functions) for the life
+//--- of the process.
+struct function_table {
+  std::vector<registered_function> functions;
+  std::map<std::string,int> ids;
+  std::size_t generation = 0;
+};
+
+//--- Generation of the current snapshot, so that a VM can tell it is
+//--- up to date without reading the snapshot
+extern std::atomic<std::size_t> function_table_generation;
+
+void register_function(const std::string& name,const std::string& code);
+void register_functions(const std::map<std::string,std::string>& fns);
+int find_function_id(const std::string& name);
+boost::shared_ptr<const std::string> find_function(const std::string& name);
 
 //--- A wrapper for the Lua object. Allows us to add state.
 class Lua {
@@ -219,8 +1133,41 @@ public:
   std::atomic<bool> busy;
 private:
   lua_State *L;
+  std::size_t synced_generation = 0;
+  // Load registered functions on first use instead of on sync
+  bool lazy_functions;
+  // Registry reference to a table holding loaded registered
+  // functions by ID+1, and the generation each was loaded at
+  int fn_cache_ref;
+  std::vector<std::size_t> fn_loaded;
+  // Large strings this VM has pushed or packed, each with a registry
+  // reference to its Lua string, also found by that string's bytes
+  struct shared_string_entry {
+    shared_string_ptr str;
+    int ref;
+  };
+  std::map<const shared_string *,shared_string_entry> shared_strings;
+  std::map<const char *,shared_string_ptr> shared_string_data;
+  std::size_t shared_string_bytes = 0;
+  void remember_shared_string(lua_State *L_,int index,const shared_string_ptr& s);
   public:
   Lua();
+  // Number of entries in the VM's atom cache (see lua_atom())
+  std::size_t atom_cache_size = 0;
+  // Number of functions in the VM's bytecode cache (see load_cached())
+  std::size_t proto_cache_size = 0;
+  // Load registered functions changed since the last call
+  void sync_registry();
+  // Push registered function id, loading it if needed
+  bool push_function(int id);
+  // Push s, reusing the Lua string made for it before
+  void push_shared_string(lua_State *L_,const shared_string_ptr& s);
+  // The shared_string for the Lua string at index, reusing the
+  // one it was pushed from or first packed into
+  shared_string_ptr share_string(lua_State *L_,int index);
+  // Drop the strings kept by the two above, as when the VM goes
+  // back to the pool
+  void clear_shared_strings();
   ~Lua() {
     lua_close(L);
   }
@@ -230,12 +1177,78 @@ private:
 };
 Lua *get_lua_ptr();
 void set_lua_ptr(Lua *lua);
+// The Lua object that owns L, or nullptr for other states
+Lua *lua_vm(lua_State *L);
+
+//--- Limits on the large strings a VM keeps while in use (see
+//--- shared_string). Going over either drops them all, and so does
+//--- returning the VM to the pool.
+const std::size_t shared_string_cache_cap = 32;
+const std::size_t shared_string_cache_bytes = 8 << 20;
+
+//--- Most Lua strings each VM keeps in its cache of atoms
+const std::size_t atom_cache_cap = 4096;
+
+//--- Number of separately locked parts of the process's atom table
+const std::size_t atom_shards = 64;
+
+//--- Most functions each VM keeps in its cache of loaded bytecode
+const std::size_t proto_cache_cap = 256;
+
+//--- Most functions each locality keeps by hash for remote calls
+//--- before the oldest are dropped (see compact_closure())
+const std::size_t bytecode_store_cap = 1024;
+
+//--- Sizing of the Lua VM pool. Each OS thread caches up to
+//--- lua_pool_slots idle VMs. VMs released while those slots are
+//--- full go to a shared overflow list of at most
+//--- lua_pool_overflow_cap entries, and only beyond that are deleted.
+const int lua_pool_slots = 4;
+const std::size_t lua_pool_overflow_cap = 64;
+
+//--- Counters describing how the Lua VM pool is behaving
+struct lua_pool_stats {
+  std::size_t hits = 0;          // served from the thread's own slots
+  std::size_t overflow_hits = 0; // served from the shared overflow list
+  std::size_t misses = 0;        // nothing cached, a new VM was built
+  std::size_t allocs = 0;        // VMs constructed
+  std::size_t frees = 0;         // VMs deleted because the pool was full
+};
+lua_pool_stats get_lua_pool_stats();
+
+//--- Build xlua.prewarm_vms VMs (default 1) per worker thread on
+//--- every locality, so the first wave of tasks finds them ready.
+void prewarm_lua_vms();
+int prewarm_lua_vms_local(int n);
 
 //--- Thread-specific ptr deletes objects on reset. Circumvent this.
+//--- The counters are only written by the owning thread and are
+//--- summed up by get_lua_pool_stats(). A holder deleted with its
+//--- thread unregisters itself and hands its counts on.
 struct LuaHolder {
-  Lua *held;
-  LuaHolder() { held = new Lua(); }
-  ~LuaHolder() {}
+  Lua *held[lua_pool_slots];
+  int count;
+  std::atomic<std::size_t> hits, overflow_hits, misses, allocs, frees;
+  // Registry epoch in which this thread started reading the function
+  // registry, or 0, and how deeply its registry_readers are nested
+  std::atomic<std::uint64_t> registry_epoch;
+  int registry_depth;
+  LuaHolder() : count(0), hits(0), overflow_hits(0), misses(0), allocs(0), frees(0),
+    registry_epoch(0), registry_depth(0) {}
+  ~LuaHolder();
+};
+LuaHolder *get_lua_holder();
+
+//--- Access to the current function registry snapshot, which stays
+//--- valid for the reader's lifetime. Marks the OS thread as reading
+//--- in the current registry epoch, so a reader must not suspend its
+//--- HPX thread. Readers nest.
+class registry_reader {
+  LuaHolder *holder;
+public:
+  registry_reader();
+  ~registry_reader();
+  const function_table *get() const;
 };
 
 //--- Safeguard the use of a Lua VM
@@ -246,6 +1259,9 @@ public:
   lua_State *get_state() {
     return L;
   }
+  Lua *get_lua() {
+    return ptr;
+  }
   LuaEnv();
   ~LuaEnv();
   operator lua_State *() {
@@ -31,8 +31,14 @@ int istable(lua_State *L);
 int islocality(lua_State *L);
 int isvector(lua_State *L);
 int get_mtable(lua_State *L);
+void tag_metatable(lua_State *L,const char *name);
+const char *xlua_type(lua_State *L,int index);
 
 int hpx_run(lua_State *L);
+int xlua_pool_stats(lua_State *L);
+int xlua_holder_stats(lua_State *L);
+void push_key(lua_State *L,const key_type& kt);
+key_type lua_number_key(lua_State *L,int index);
 
 
 int luax_run_guarded(lua_State *L);
@@ -55,7 +61,36 @@ int vector_pop(lua_State *L);
 
 const char *lua_read(lua_State *L,void *data,size_t *size);
 int lua_write(lua_State *L,const char *str,unsigned long len,std::string *buf);
+void dump_function(lua_State *L,int index,std::string& code,std::uint64_t *hash = nullptr);
 bool cmp_meta(lua_State *L,int index,const char *meta_name);
+std::uint64_t bytecode_hash(const std::string& code);
+int load_cached(lua_State *L,const std::string& code,std::uint64_t h = 0);
+void compact_closure(Closure& cl,const hpx::naming::id_type& dest);
+void expand_closure(Closure& cl);
+atom lua_atom(lua_State *L,int index);
+void freeze_value(Holder& h);
+void compact_frozen(holder_list& args,const hpx::naming::id_type& dest,holder_list& keep);
+void compact_frozen(Closure& cl,const hpx::naming::id_type& dest,holder_list& keep);
+future_type keep_frozen(future_type f,ptr_type keep);
+void expand_frozen(holder_list& args);
+void expand_frozen(Closure& cl);
+int table_freeze(lua_State *L);
+int vector_freeze(lua_State *L);
+bool has_upvalues(const std::vector<ClosureVar>& vars);
+hpx::shared_future<void> registration_for(const hpx::naming::id_type& dest);
+
+//--- Run f, which makes a remote call to dest, once dest has every
+//--- registered function (see broadcast_registration())
+template<typename F>
+future_type after_registration(const hpx::naming::id_type& dest,F f) {
+  hpx::shared_future<void> pending = registration_for(dest);
+  if(pending.is_ready())
+    return f();
+  return pending.then([f](hpx::shared_future<void>) {
+    return f().get();
+  });
+}
+void bind_upvalues(lua_State *L,int findex,std::vector<ClosureVar>& vars,unpack_memo *memo = nullptr);
 
 int open_hpx(lua_State *L);
 int open_component(lua_State *L);